@@ -0,0 +1,213 @@
+#pragma once
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <linux/fs.h>
+#include <map>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <sstream>
+#include <stdexcept>
+#include <string.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+#include <zstd.h>
+
+#include "bundle.hpp"
+#include "decompress.hpp"
+#include "hash.hpp"
+#include "pool.hpp"
+#include "writers.hpp"
+
+// "save query" answers with a status line, then "path:size, path:size, ..." once the world is ready to copy.
+// Returns the files with the length that is consistent, empty while the save is still running.
+inline std::vector<std::pair<std::string, uint64_t>> parse_save_query(std::string const &output) {
+  std::vector<std::pair<std::string, uint64_t>> ret;
+  auto ready = output.find("Data saved");
+  if (ready == std::string::npos) return ret;
+  auto list = output.find('\n', ready);
+  if (list == std::string::npos) return ret;
+  std::string item;
+  std::istringstream in{ output.substr(list + 1) };
+  while (std::getline(in, item, ',')) {
+    auto begin = item.find_first_not_of(" \r\n");
+    auto end   = item.find_last_not_of(" \r\n");
+    if (begin == std::string::npos) continue;
+    item       = item.substr(begin, end - begin + 1);
+    auto colon = item.rfind(':');
+    if (colon == std::string::npos) continue;
+    ret.emplace_back(item.substr(0, colon), std::stoull(item.substr(colon + 1)));
+  }
+  return ret;
+}
+
+struct backup_file {
+  uint64_t size;
+  // nanoseconds, a rewrite within the same second must still count as a change
+  int64_t mtime;
+  mode_t mode;
+  std::vector<std::string> chunks;
+};
+
+inline void to_json(nlohmann::json &j, backup_file const &i) { j = { { "size", i.size }, { "mtime_ns", i.mtime }, { "mode", i.mode }, { "chunks", i.chunks } }; }
+
+inline void from_json(nlohmann::json const &j, backup_file &i) {
+  i.size   = j.value("size", 0ull);
+  i.mtime  = j.value("mtime_ns", 0ll);
+  i.mode   = j.value("mode", 0644u);
+  i.chunks = j.value("chunks", std::vector<std::string>{});
+}
+
+// Backups of one world directory. snapshot/ is the last point-in-time copy, refreshed while saves are held by
+// hard-linking unchanged files and cloning changed ones; chunks/ holds zstd compressed 1 MiB chunks named by the
+// sha256 of their content, and every backup is a json manifest of files to chunk lists.
+class backup_store {
+  std::filesystem::path root;
+  std::map<std::string, backup_file> previous, current;
+
+  static constexpr size_t chunk_size = 1 << 20;
+
+  std::filesystem::path chunk_path(std::string const &digest) const { return root / "chunks" / digest.substr(0, 2) / (digest + ".zst"); }
+
+  // a clone shares the extents when the filesystem supports it, copy_file_range lets the kernel pick otherwise
+  static void clone_file(std::filesystem::path const &from, std::filesystem::path const &to, uint64_t size, mode_t mode, timespec mtime) {
+    int in = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) throw std::runtime_error("Failed to open " + from.string() + ": " + strerror(errno));
+    guard in_guard{ [&] { close(in); } };
+    int out = ::open(to.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, mode & 07777);
+    if (out < 0) throw std::runtime_error("Failed to create " + to.string() + ": " + strerror(errno));
+    guard out_guard{ [&] { close(out); } };
+    struct stat st;
+    if (fstat(in, &st) != 0 || (uint64_t)st.st_size != size || ioctl(out, FICLONE, in) != 0) {
+      if (ftruncate(out, 0) != 0) throw std::runtime_error("Failed to truncate " + to.string() + ": " + strerror(errno));
+      copy_fd_range(in, 0, out, size);
+    }
+    struct timespec times[2] = { { 0, UTIME_OMIT }, mtime };
+    futimens(out, times);
+  }
+
+public:
+  struct stats {
+    size_t files = 0, linked = 0, cloned = 0, changed = 0, new_chunks = 0;
+    uint64_t bytes_read = 0, bytes_written = 0;
+  };
+
+  backup_store(std::filesystem::path root)
+      : root(std::move(root)) {
+    std::filesystem::create_directories(this->root / "chunks");
+    std::ifstream ifs{ this->root / "latest.json" };
+    if (!ifs) return;
+    auto manifest = nlohmann::json::parse(ifs, nullptr, false);
+    if (manifest.is_object() && manifest["files"].is_object()) previous = manifest["files"].get<std::map<std::string, backup_file>>();
+  }
+
+  // Runs while saves are held: files with the size and mtime recorded last time are hard-linked from the previous
+  // snapshot, only the others are cloned, so the pause follows the change set rather than the world size.
+  void snapshot(std::filesystem::path const &world, std::vector<std::pair<std::string, uint64_t>> const &files, stats &info) {
+    using namespace std::filesystem;
+    auto next = root / "snapshot.new", last = root / "snapshot";
+    remove_all(next);
+    create_directories(next);
+    current.clear();
+    for (auto &[name, size] : files) {
+      auto source = world / name;
+      struct stat st;
+      if (stat(source.c_str(), &st) != 0) throw std::runtime_error("Failed to stat " + source.string() + ": " + strerror(errno));
+      auto target = next / name;
+      create_directories(target.parent_path());
+      int64_t mtime = st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+      backup_file entry{ size, mtime, st.st_mode & 07777, {} };
+      info.files++;
+      if (auto it = previous.find(name); it != previous.end() && it->second.size == size && it->second.mtime == mtime) {
+        std::error_code ec;
+        create_hard_link(last / name, target, ec);
+        if (!ec) {
+          entry.chunks = it->second.chunks;
+          info.linked++;
+          current[name] = std::move(entry);
+          continue;
+        }
+      }
+      clone_file(source, target, size, st.st_mode, st.st_mtim);
+      info.cloned++;
+      current[name] = std::move(entry);
+    }
+    remove_all(last);
+    rename(next, last);
+  }
+
+  // Runs after saves resumed: chunks the files that changed, hashing and compressing the chunks on jobs threads.
+  // Chunks already in the store are only hashed.
+  void ingest(unsigned jobs, stats &info) {
+    using namespace std::filesystem;
+    worker_pool pool{ jobs };
+    std::mutex mtx;
+    std::string error;
+    std::unordered_set<std::string> seen;
+    std::vector<std::unique_ptr<mapped_file>> maps;
+    for (auto &[name, entry] : current) {
+      if (!entry.chunks.empty() || entry.size == 0) continue;
+      info.changed++;
+      info.bytes_read += entry.size;
+      auto &map = *maps.emplace_back(std::make_unique<mapped_file>(root / "snapshot" / name));
+      entry.chunks.resize((entry.size + chunk_size - 1) / chunk_size);
+      for (size_t index = 0; index < entry.chunks.size(); index++) {
+        auto offset = index * chunk_size;
+        auto length = std::min<uint64_t>(chunk_size, entry.size - offset);
+        pool.submit([&, data = map.data() + offset, length, &digest = entry.chunks[index]] {
+          try {
+            sha256 hasher;
+            hasher.update(data, length);
+            digest    = hasher.hex();
+            auto file = chunk_path(digest);
+            {
+              std::lock_guard lock{ mtx };
+              if (!seen.insert(digest).second) return;
+            }
+            if (exists(file)) return;
+            create_directories(file.parent_path());
+            std::string packed(ZSTD_compressBound(length), '\0');
+            auto size = ZSTD_compress(packed.data(), packed.size(), data, length, 3);
+            if (ZSTD_isError(size)) throw std::runtime_error(ZSTD_getErrorName(size));
+            auto temp = file.string() + ".tmp";
+            int fd    = ::open(temp.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0) throw std::runtime_error("Failed to create " + temp + ": " + strerror(errno));
+            guard fd_guard{ [&] { close(fd); } };
+            write_fd(fd, packed.data(), size);
+            rename(temp, file);
+            std::lock_guard lock{ mtx };
+            info.new_chunks++;
+            info.bytes_written += size;
+          } catch (std::exception &ex) {
+            std::lock_guard lock{ mtx };
+            if (error.empty()) error = ex.what();
+          }
+        });
+      }
+    }
+    pool.wait_idle();
+    if (!error.empty()) throw std::runtime_error("Backup failed: " + error);
+  }
+
+  // records the backup under its timestamp and as the base of the next one
+  std::filesystem::path commit() {
+    nlohmann::json manifest = { { "time", time(nullptr) }, { "files", current } };
+    auto text               = manifest.dump();
+    auto file               = root / (std::to_string(time(nullptr)) + ".json");
+    for (auto &target : { file, root / "latest.json" }) {
+      auto temp = target.string() + ".tmp";
+      std::ofstream{ temp } << text;
+      std::filesystem::rename(temp, target);
+    }
+    return file;
+  }
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <rpcws.hpp>
+#include <signal.h>
+#include <string>
+#include <sys/prctl.h>
+#include <unistd.h>
+#include <vector>
+
+// Round trip times of one benchmark run, percentiles are taken from the sorted samples
+class latency_recorder {
+  std::vector<uint32_t> samples; // microseconds
+  size_t failures = 0;
+
+public:
+  latency_recorder() { samples.reserve(1 << 20); }
+
+  void record(std::chrono::steady_clock::duration elapsed) {
+    samples.push_back(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+  }
+  void fail() { failures++; }
+
+  void report(FILE *out, std::chrono::steady_clock::duration wall) {
+    std::sort(samples.begin(), samples.end());
+    auto at = [&](double q) -> double {
+      if (samples.empty()) return 0;
+      return samples[std::min(samples.size() - 1, (size_t)(q * samples.size()))] / 1000.0;
+    };
+    double seconds = std::chrono::duration<double>(wall).count();
+    fprintf(out, "%zu request(s), %zu failed in %.2fs: %.0f req/s\n", samples.size(), failures, seconds, samples.size() / seconds);
+    fprintf(out, "latency p50 %.3fms p99 %.3fms p999 %.3fms max %.3fms\n", at(0.5), at(0.99), at(0.999), samples.empty() ? 0.0 : samples.back() / 1000.0);
+  }
+};
+
+// Stand-in for nsgod and a service api socket, answering the benchmarked methods with fixed replies.
+// Runs in a forked child with its own loop, so client and server do not share a thread.
+inline pid_t spawn_stub_server(std::filesystem::path const &dir) {
+  using namespace rpcws;
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  auto loop = std::make_shared<epoll>();
+  static RPC nsgod{ std::make_unique<server_wsio>("ws+unix://" + (dir / "nsgod.socket").string(), loop) };
+  static RPC api{ std::make_unique<server_wsio>("ws+unix://" + (dir / "api.socket").string(), loop) };
+  nsgod.reg("ping", [](auto, json) -> json { return json::object({}); });
+  nsgod.reg("status", [](auto, json) -> json {
+    json ret = json::object({});
+    for (int i = 0; i < 16; i++) ret["stub-" + std::to_string(i)] = { { "status", "running" } };
+    return ret;
+  });
+  // the method CommandService::execute is bound to on the service side
+  api.reg("command.execute", [](auto, json input) -> json { return "stub: " + input.value("content", ""); });
+  nsgod.start();
+  api.start();
+  loop->wait();
+  _exit(0);
+}
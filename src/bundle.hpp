@@ -0,0 +1,184 @@
+#pragma once
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <errno.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <map>
+#include <nlohmann/json.hpp>
+#include <stdexcept>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "decompress.hpp"
+#include "hash.hpp"
+#include "writers.hpp"
+
+// Read-only mapping of a whole file, the archive is consumed straight from the page cache
+class mapped_file {
+  int fd          = -1;
+  char const *ptr = nullptr;
+  uint64_t length = 0;
+
+public:
+  mapped_file(std::filesystem::path const &file) {
+    fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Failed to open " + file.string() + ": " + strerror(errno));
+    struct stat st;
+    void *ret = nullptr;
+    if (fstat(fd, &st) == 0) {
+      length = st.st_size;
+      if (length == 0) return;
+      ret = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (!ret || ret == MAP_FAILED) {
+      auto message = "Failed to map " + file.string() + ": " + strerror(errno);
+      close(fd);
+      throw std::runtime_error(message);
+    }
+    ptr = (char const *)ret;
+    madvise(ret, length, MADV_SEQUENTIAL);
+  }
+  mapped_file(mapped_file const &) = delete;
+  ~mapped_file() {
+    if (ptr) munmap((void *)ptr, length);
+    if (fd >= 0) close(fd);
+  }
+
+  int handle() const { return fd; }
+  char const *data() const { return ptr; }
+  uint64_t size() const { return length; }
+};
+
+// An archive available without the network: a whole file, or a slice of a bundle
+struct local_artifact {
+  std::filesystem::path file;
+  uint64_t offset = 0, size = 0;
+  // known up front when the artifact comes from a bundle
+  std::string sha256;
+};
+
+// Bundle layout: the magic, the length of the json index as 8 little endian bytes, the index, then every
+// archive at a page aligned offset. The index lists name, offset, size and sha256 of each archive.
+constexpr char bundle_magic[8]  = { 'S', 'T', 'O', 'N', 'E', 'B', 'D', 'L' };
+constexpr uint64_t bundle_align = 4096;
+
+inline bool is_bundle(std::filesystem::path const &file) {
+  char magic[sizeof bundle_magic];
+  int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  auto ret = pread(fd, magic, sizeof magic, 0);
+  close(fd);
+  return ret == sizeof magic && memcmp(magic, bundle_magic, sizeof magic) == 0;
+}
+
+inline std::map<std::string, local_artifact> read_bundle(std::filesystem::path const &file) {
+  mapped_file map{ file };
+  auto fail = [&](char const *reason) { return std::runtime_error("Invalid bundle " + file.string() + ": " + reason); };
+  if (map.size() < sizeof bundle_magic + 8 || memcmp(map.data(), bundle_magic, sizeof bundle_magic) != 0) throw fail("bad magic");
+  uint64_t length = 0;
+  for (int i = 7; i >= 0; i--) length = (length << 8) | (unsigned char)map.data()[sizeof bundle_magic + i];
+  if (length > map.size() - sizeof bundle_magic - 8) throw fail("index is truncated");
+  auto index = nlohmann::json::parse(map.data() + sizeof bundle_magic + 8, map.data() + sizeof bundle_magic + 8 + length, nullptr, false);
+  if (!index.is_object() || !index["components"].is_array()) throw fail("malformed index");
+  std::map<std::string, local_artifact> ret;
+  for (auto &item : index["components"]) {
+    local_artifact artifact{ file, item.value("offset", 0ull), item.value("size", 0ull), item.value("sha256", "") };
+    if (artifact.offset > map.size() || artifact.size > map.size() - artifact.offset) throw fail("archive is truncated");
+    ret[item.value("name", "")] = artifact;
+  }
+  return ret;
+}
+
+// archives are named after the component they carry, e.g. core.tar.zst, game.tar.gz or plain nsgod
+inline std::string artifact_name(std::filesystem::path const &file) {
+  static char const *const suffixes[] = { ".tar.gz", ".tgz", ".tar.zst", ".tzst", ".tar.xz", ".txz" };
+  auto name = file.filename().string();
+  for (auto suffix : suffixes) {
+    auto len = strlen(suffix);
+    if (name.size() > len && name.compare(name.size() - len, len, suffix) == 0) return name.substr(0, name.size() - len);
+  }
+  return name.find('.') == std::string::npos ? name : std::string{};
+}
+
+// --from accepts a bundle, a single archive or a mirror directory holding either
+inline std::map<std::string, local_artifact> find_local_artifacts(std::filesystem::path const &from) {
+  using namespace std::filesystem;
+  std::map<std::string, local_artifact> ret;
+  auto add = [&](path const &file, bool explicit_file) {
+    if (is_bundle(file)) {
+      for (auto &[name, artifact] : read_bundle(file)) ret.emplace(name, artifact);
+      return;
+    }
+    auto name = artifact_name(file);
+    if (name.empty() && explicit_file) throw std::runtime_error("Cannot tell which component " + file.string() + " holds");
+    if (!name.empty()) ret.emplace(name, local_artifact{ file, 0, file_size(file), {} });
+  };
+  if (is_directory(from)) {
+    std::vector<path> files;
+    for (auto &item : directory_iterator(from))
+      if (item.is_regular_file()) files.push_back(item.path());
+    // archives placed next to a bundle take precedence over its contents
+    std::sort(files.begin(), files.end(), [](auto &a, auto &b) { return !is_bundle(a) && is_bundle(b); });
+    for (auto &file : files) add(file, false);
+  } else {
+    add(from, true);
+  }
+  return ret;
+}
+
+// packs the archives into one file that can be installed with --from, returns the written index
+inline nlohmann::json write_bundle(std::filesystem::path const &output, std::map<std::string, local_artifact> const &inputs) {
+  nlohmann::json index = { { "version", 1 }, { "components", nlohmann::json::array() } };
+  for (auto &[name, artifact] : inputs) {
+    auto digest = artifact.sha256;
+    if (digest.empty()) {
+      mapped_file map{ artifact.file };
+      sha256 hasher;
+      if (artifact.size) hasher.update(map.data() + artifact.offset, artifact.size);
+      digest = hasher.hex();
+    }
+    index["components"].push_back({ { "name", name }, { "offset", 0 }, { "size", artifact.size }, { "sha256", digest } });
+  }
+  // the offsets depend on the size of the index that records them, repeat until it stops growing
+  size_t index_size;
+  do {
+    index_size      = index.dump().size();
+    uint64_t offset = sizeof bundle_magic + 8 + index_size;
+    for (auto &item : index["components"]) {
+      offset         = (offset + bundle_align - 1) / bundle_align * bundle_align;
+      item["offset"] = offset;
+      offset += item["size"].get<uint64_t>();
+    }
+  } while (index.dump().size() != index_size);
+  auto text = index.dump();
+  auto temp = output.string() + ".tmp";
+  int fd    = ::open(temp.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) throw std::runtime_error("Failed to create " + temp + ": " + strerror(errno));
+  guard fd_guard{ [&] { close(fd); } };
+  char length[8];
+  for (int i = 0; i < 8; i++) length[i] = (text.size() >> (i * 8)) & 0xff;
+  write_fd(fd, bundle_magic, sizeof bundle_magic);
+  write_fd(fd, length, sizeof length);
+  write_fd(fd, text.data(), text.size());
+  size_t i = 0;
+  for (auto &[name, artifact] : inputs) {
+    auto offset = index["components"][i++]["offset"].get<uint64_t>();
+    if (ftruncate(fd, offset) != 0 || lseek(fd, offset, SEEK_SET) < 0) throw std::runtime_error(std::string("Failed to write bundle: ") + strerror(errno));
+    int in = ::open(artifact.file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) throw std::runtime_error("Failed to open " + artifact.file.string() + ": " + strerror(errno));
+    guard in_guard{ [&] { close(in); } };
+    copy_fd_range(in, artifact.offset, fd, artifact.size);
+  }
+  if (fsync(fd) != 0) throw std::runtime_error(std::string("Failed to write bundle: ") + strerror(errno));
+  std::filesystem::rename(temp, output);
+  return index;
+}
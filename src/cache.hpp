@@ -0,0 +1,132 @@
+#pragma once
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <stdexcept>
+#include <string.h>
+#include <string>
+#include <sys/file.h>
+#include <unistd.h>
+
+struct cache_entry {
+  std::string etag, last_modified, sha256;
+  uint64_t size;
+};
+
+inline void to_json(nlohmann::json &j, const cache_entry &i) {
+  j["etag"]          = i.etag;
+  j["last_modified"] = i.last_modified;
+  j["sha256"]        = i.sha256;
+  j["size"]          = i.size;
+}
+
+inline void from_json(const nlohmann::json &j, cache_entry &i) {
+  i.etag          = j.value("etag", "");
+  i.last_modified = j.value("last_modified", "");
+  i.sha256        = j.value("sha256", "");
+  i.size          = j.value("size", 0);
+}
+
+// Content-addressed store for downloaded artifacts: blobs are named by their sha256, and index.json maps
+// each url to the validators (ETag/Last-Modified) of the response the blob came from. Several installs
+// may share one directory, so index updates are serialized with flock.
+class download_cache {
+  std::filesystem::path dir;
+
+  struct index_lock {
+    int fd;
+    index_lock(std::filesystem::path const &file, int op) {
+      fd = ::open(file.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+      if (fd >= 0) flock(fd, op);
+    }
+    ~index_lock() {
+      if (fd >= 0) close(fd);
+    }
+  };
+
+  nlohmann::json read_index() {
+    std::ifstream ifs{ dir / "index.json" };
+    if (!ifs) return nlohmann::json::object();
+    auto ret = nlohmann::json::parse(ifs, nullptr, false);
+    return ret.is_object() ? ret : nlohmann::json::object();
+  }
+
+public:
+  download_cache(std::filesystem::path dir)
+      : dir(std::move(dir)) {
+    std::filesystem::create_directories(this->dir);
+  }
+
+  std::filesystem::path const &path() const { return dir; }
+  std::filesystem::path blob(std::string const &sha256) const { return dir / sha256; }
+  bool has(std::string const &sha256) const { return !sha256.empty() && std::filesystem::is_regular_file(blob(sha256)); }
+
+  // only returns entries whose blob is still present
+  std::optional<cache_entry> lookup(std::string const &url) {
+    index_lock lock{ dir / ".lock", LOCK_SH };
+    auto index = read_index();
+    if (!index.contains(url)) return std::nullopt;
+    auto entry = index[url].get<cache_entry>();
+    if (!has(entry.sha256)) return std::nullopt;
+    return entry;
+  }
+
+  void store(std::string const &url, cache_entry const &entry) {
+    index_lock lock{ dir / ".lock", LOCK_EX };
+    auto index = read_index();
+    index[url] = entry;
+    auto temp  = dir / "index.json.tmp";
+    {
+      std::ofstream ofs{ temp };
+      ofs << index.dump(2);
+    }
+    std::filesystem::rename(temp, dir / "index.json");
+  }
+};
+
+// Receives a blob while it is downloaded and moves it to its content address once the hash is known
+class cache_writer {
+  std::filesystem::path dir;
+  std::string temp;
+  int fd = -1;
+
+public:
+  cache_writer(std::filesystem::path dir)
+      : dir(std::move(dir))
+      , temp((this->dir / ".partial.XXXXXX").string()) {
+    fd = mkostemp(temp.data(), O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error(std::string("Failed to create cache file: ") + strerror(errno));
+  }
+  cache_writer(cache_writer const &) = delete;
+  ~cache_writer() {
+    if (fd >= 0) {
+      close(fd);
+      unlink(temp.c_str());
+    }
+  }
+
+  void write(char const *data, size_t size) {
+    while (size) {
+      auto ret = ::write(fd, data, size);
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        throw std::runtime_error(std::string("Failed to write cache file: ") + strerror(errno));
+      }
+      data += ret;
+      size -= ret;
+    }
+  }
+
+  void commit(std::string const &sha256) {
+    close(fd);
+    fd = -1;
+    std::filesystem::rename(temp, dir / sha256);
+  }
+};
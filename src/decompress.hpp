@@ -3,16 +3,21 @@
 #define _GNU_SOURCE
 #endif
 
+#include <algorithm>
 #include <cstdio>
 #include <errno.h>
 #include <fcntl.h>
 #include <filesystem>
-#include <libtar.h>
+#include <lzma.h>
+#include <memory>
 #include <stdexcept>
 #include <string.h>
+#include <string>
 #include <sys/mman.h>
 #include <sys/param.h>
+#include <thread>
 #include <zlib.h>
+#include <zstd.h>
 
 #define CHUNK 16384
 
@@ -22,53 +27,213 @@ template <typename F> struct guard {
 };
 template <typename F> guard(F)->guard<F>;
 
-template <typename R, typename F> void degz(R eat, F feed) {
+inline void inflate_check(int ret) {
+  switch (ret) {
+  case Z_OK:
+  case Z_STREAM_END: return;
+  case Z_NEED_DICT: throw std::runtime_error("Compressed file need dict");
+  case Z_ERRNO: throw std::runtime_error(strerror(errno));
+  case Z_STREAM_ERROR: throw std::runtime_error("Stream error");
+  case Z_DATA_ERROR: throw std::runtime_error("Compressed file is corrupt");
+  case Z_MEM_ERROR: throw std::runtime_error("Memory allocation failed");
+  case Z_BUF_ERROR: throw std::runtime_error("Compressed file is truncated or otherwise corrupt");
+  case Z_VERSION_ERROR: throw std::runtime_error("Compressed file version mismatched");
+  default: throw std::runtime_error("Unknown error");
+  }
+}
+
+// One compression format behind the decompressor. step decodes as much of the input as fits into out,
+// advancing in/in_size and setting out_size to the bytes produced; it returns true once the stream ended.
+class codec {
+public:
+  virtual ~codec() = default;
+  virtual bool step(char const *&in, size_t &in_size, char *out, size_t &out_size) = 0;
+};
+
+class gzip_codec : public codec {
   z_stream zs{};
-  int flush = 0;
-  int ret   = inflateInit2(&zs, 16 + MAX_WBITS);
-  if (ret != Z_OK) throw std::runtime_error("zlib stream init failed");
-  guard zs_guard{ [&] { inflateEnd(&zs); } };
-  char in[CHUNK], out[CHUNK];
-  bool done = false;
-  do {
-    zs.avail_in = eat(in, CHUNK);
-    if (zs.avail_in == 0) throw std::runtime_error("Compressed file is truncated");
-    zs.next_in = (decltype(zs.next_in))in;
-    do {
-      zs.avail_out = CHUNK;
-      zs.next_out  = (decltype(zs.next_out))out;
-      ret          = inflate(&zs, flush);
-      switch (ret) {
-      case Z_OK: break;
-      case Z_STREAM_END: done = true; break;
-      case Z_NEED_DICT: throw std::runtime_error("Compressed file need dict");
-      case Z_ERRNO: throw std::runtime_error(strerror(errno));
-      case Z_STREAM_ERROR: throw std::runtime_error("Stream error");
-      case Z_DATA_ERROR: throw std::runtime_error("Compressed file is corrupt");
-      case Z_MEM_ERROR: throw std::runtime_error("Memory allocation failed");
-      case Z_BUF_ERROR: throw std::runtime_error("Compressed file is truncated or otherwise corrupt");
-      case Z_VERSION_ERROR: throw std::runtime_error("Compressed file version mismatched");
-      default: throw std::runtime_error("Unknown error");
+  bool ended = false;
+
+public:
+  gzip_codec() {
+    if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) throw std::runtime_error("zlib stream init failed");
+  }
+  ~gzip_codec() { inflateEnd(&zs); }
+
+  bool step(char const *&in, size_t &in_size, char *out, size_t &out_size) override {
+    if (ended) {
+      // gzip allows several members back to back, anything else after the end is ignored like gzip does
+      if (!in_size || in[0] != '\x1f') {
+        in += in_size;
+        in_size  = 0;
+        out_size = 0;
+        return true;
       }
-      auto have = CHUNK - zs.avail_out;
-      if (have) feed(out, have);
-    } while (zs.avail_out == 0);
-  } while (!done);
-}
+      inflateReset(&zs);
+      ended = false;
+    }
+    zs.next_in   = (decltype(zs.next_in))in;
+    zs.avail_in  = in_size;
+    zs.next_out  = (decltype(zs.next_out))out;
+    zs.avail_out = out_size;
+    int ret      = inflate(&zs, Z_NO_FLUSH);
+    // Z_BUF_ERROR only means no progress was possible
+    if (ret != Z_BUF_ERROR) inflate_check(ret);
+    in += in_size - zs.avail_in;
+    in_size  = zs.avail_in;
+    out_size = out_size - zs.avail_out;
+    return ended = ret == Z_STREAM_END;
+  }
+};
+
+class zstd_codec : public codec {
+  ZSTD_DCtx *ctx;
+
+public:
+  zstd_codec() {
+    ctx = ZSTD_createDCtx();
+    if (!ctx) throw std::runtime_error("zstd stream init failed");
+    // accept archives compressed with --long, which need windows beyond the default limit
+    ZSTD_DCtx_setParameter(ctx, ZSTD_d_windowLogMax, 31);
+  }
+  ~zstd_codec() { ZSTD_freeDCtx(ctx); }
+
+  bool step(char const *&in, size_t &in_size, char *out, size_t &out_size) override {
+    ZSTD_inBuffer input{ in, in_size, 0 };
+    ZSTD_outBuffer output{ out, out_size, 0 };
+    auto ret = ZSTD_decompressStream(ctx, &output, &input);
+    if (ZSTD_isError(ret)) throw std::runtime_error(std::string("Compressed file is corrupt: ") + ZSTD_getErrorName(ret));
+    in += input.pos;
+    in_size -= input.pos;
+    out_size = output.pos;
+    // 0 means the current frame is fully flushed, a following frame simply continues the stream
+    return ret == 0;
+  }
+};
+
+class xz_codec : public codec {
+  lzma_stream strm = LZMA_STREAM_INIT;
+  bool ended       = false;
+
+  static void check(lzma_ret ret) {
+    switch (ret) {
+    case LZMA_OK:
+    case LZMA_STREAM_END: return;
+    case LZMA_MEM_ERROR: throw std::runtime_error("Memory allocation failed");
+    case LZMA_MEMLIMIT_ERROR: throw std::runtime_error("Compressed file needs too much memory");
+    case LZMA_FORMAT_ERROR: throw std::runtime_error("Compressed file is not in xz format");
+    case LZMA_OPTIONS_ERROR: throw std::runtime_error("Compressed file uses unsupported options");
+    case LZMA_DATA_ERROR: throw std::runtime_error("Compressed file is corrupt");
+    case LZMA_BUF_ERROR: throw std::runtime_error("Compressed file is truncated or otherwise corrupt");
+    default: throw std::runtime_error("Unknown error");
+    }
+  }
+
+public:
+  xz_codec(unsigned threads) {
+#if LZMA_VERSION >= 50040002
+    // blocks of files compressed with xz -T are decoded in parallel, single block files fall back to one thread
+    lzma_mt mt{};
+    mt.threads            = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    mt.memlimit_threading = lzma_physmem() / 4;
+    mt.memlimit_stop      = UINT64_MAX;
+    check(lzma_stream_decoder_mt(&strm, &mt));
+#else
+    (void)threads;
+    check(lzma_stream_decoder(&strm, UINT64_MAX, 0));
+#endif
+  }
+  ~xz_codec() { lzma_end(&strm); }
+
+  bool step(char const *&in, size_t &in_size, char *out, size_t &out_size) override {
+    if (ended) {
+      // stream padding or trailing garbage
+      in += in_size;
+      in_size  = 0;
+      out_size = 0;
+      return true;
+    }
+    strm.next_in   = (uint8_t const *)in;
+    strm.avail_in  = in_size;
+    strm.next_out  = (uint8_t *)out;
+    strm.avail_out = out_size;
+    auto ret       = lzma_code(&strm, LZMA_RUN);
+    if (ret != LZMA_BUF_ERROR) check(ret);
+    in += in_size - strm.avail_in;
+    in_size  = strm.avail_in;
+    out_size = out_size - strm.avail_out;
+    return ended = ret == LZMA_STREAM_END;
+  }
+};
+
+// Push-mode decompressor: input arrives in arbitrary pieces (e.g. from a curl write callback), the format
+// is detected from the magic bytes of the first piece, and every decoded block is handed to feed right away,
+// so memory stays bounded by the output buffer
+class decompressor {
+  std::unique_ptr<codec> impl;
+  std::unique_ptr<char[]> out;
+  size_t out_size;
+  unsigned threads;
+  std::string header;
+  bool ended = false;
 
-void untar(int infile, std::filesystem::path prefix, char const *name) {
-  using namespace std::filesystem;
-  TAR *tar{};
-  auto ret = tar_fdopen(&tar, infile, "!.tar", NULL, O_RDONLY, 0, 0);
-  if (ret != 0) throw std::runtime_error("tar stream init failed");
-  guard tar_guard{ [&] { tar_close(tar); } };
-  int i;
-  while ((i = th_read(tar)) == 0) {
-    path target = prefix / th_get_pathname(tar);
-    printf("\r\033[2K[%-5s]Writing %s", name, target.c_str());
-    fflush(stdout);
-    if (exists(target) && is_regular_file(target)) remove(target);
-    if (tar_extract_file(tar, target.string().data()) != 0) throw std::runtime_error(std::string("tar extract failed: ") + strerror(errno));
+  static constexpr size_t magic_size = 6;
+
+  static std::unique_ptr<codec> detect(std::string const &magic, unsigned threads) {
+    if (magic.compare(0, 2, "\x1f\x8b") == 0) return std::make_unique<gzip_codec>();
+    if (magic.compare(0, 4, "\x28\xb5\x2f\xfd") == 0) return std::make_unique<zstd_codec>();
+    if (magic.compare(0, 6, std::string("\xfd" "7zXZ\0", 6)) == 0) return std::make_unique<xz_codec>(threads);
+    throw std::runtime_error("Unknown compression format");
   }
-  if (i != 1) throw std::runtime_error(std::string("tar extract failed: ") + strerror(errno));
-}
\ No newline at end of file
+
+  template <typename F> void run(char const *data, size_t size, F &feed) {
+    while (true) {
+      size_t have = out_size, before = size;
+      ended       = impl->step(data, size, out.get(), have);
+      if (have) feed(out.get(), have);
+      // a full buffer may leave more output pending
+      if (have == out_size) continue;
+      if (size == 0) break;
+      if (have == 0 && size == before) throw std::runtime_error("Compressed file is corrupt");
+    }
+  }
+
+public:
+  // threads only applies to formats that can decode in parallel, 0 picks one per core
+  decompressor(size_t out_size = CHUNK, unsigned threads = 0)
+      : out(new char[out_size])
+      , out_size(out_size)
+      , threads(threads) {}
+  decompressor(decompressor const &) = delete;
+
+  template <typename F> void push(char const *data, size_t size, F feed) {
+    if (!impl) {
+      auto take = std::min(size, magic_size - header.size());
+      header.append(data, take);
+      data += take;
+      size -= take;
+      if (header.size() < magic_size) return;
+      impl = detect(header, threads);
+      run(header.data(), header.size(), feed);
+    }
+    if (size) run(data, size, feed);
+  }
+
+  bool finished() const { return impl && ended; }
+};
+
+// Pull-mode wrapper: eat(buffer, size) reads like read(2), feed receives the decoded blocks
+template <typename R, typename F> void decompress(R eat, F feed, size_t buffer_size = CHUNK) {
+  decompressor dec{ buffer_size };
+  std::unique_ptr<char[]> in{ new char[buffer_size] };
+  while (true) {
+    auto got = eat(in.get(), buffer_size);
+    if (got < 0) {
+      if (errno == EINTR) continue;
+      throw std::runtime_error(strerror(errno));
+    }
+    if (got == 0) break;
+    dec.push(in.get(), got, feed);
+  }
+  if (!dec.finished()) throw std::runtime_error("Compressed file is truncated");
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <mbedtls/sha256.h>
+#include <string>
+
+class sha256 {
+  mbedtls_sha256_context ctx;
+
+public:
+  sha256() {
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts_ret(&ctx, 0);
+  }
+  sha256(sha256 const &) = delete;
+  ~sha256() { mbedtls_sha256_free(&ctx); }
+
+  void update(void const *data, size_t size) { mbedtls_sha256_update_ret(&ctx, (unsigned char const *)data, size); }
+
+  std::string hex() {
+    static char const digits[] = "0123456789abcdef";
+    unsigned char out[32];
+    mbedtls_sha256_finish_ret(&ctx, out);
+    std::string ret;
+    for (auto ch : out) {
+      ret += digits[ch >> 4];
+      ret += digits[ch & 15];
+    }
+    return ret;
+  }
+};
+
+// Streaming XXH64, used where we only need to tell whether content changed
+class xxh64 {
+  static constexpr uint64_t p1 = 11400714785074694791ULL, p2 = 14029467366897019727ULL, p3 = 1609587929392839161ULL;
+  static constexpr uint64_t p4 = 9650029242287828579ULL, p5 = 2870177450012600261ULL;
+
+  uint64_t v[4];
+  uint64_t total = 0;
+  unsigned char buffer[32];
+  size_t buffered = 0;
+
+  static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+  static uint64_t read64(unsigned char const *p) {
+    uint64_t ret;
+    memcpy(&ret, p, 8);
+    return ret;
+  }
+  static uint32_t read32(unsigned char const *p) {
+    uint32_t ret;
+    memcpy(&ret, p, 4);
+    return ret;
+  }
+  static uint64_t round(uint64_t acc, uint64_t input) { return rotl(acc + input * p2, 31) * p1; }
+  static uint64_t merge(uint64_t acc, uint64_t val) { return (acc ^ round(0, val)) * p1 + p4; }
+
+  void consume(unsigned char const *p) {
+    for (int i = 0; i < 4; i++) v[i] = round(v[i], read64(p + i * 8));
+  }
+
+public:
+  xxh64(uint64_t seed = 0)
+      : v{ seed + p1 + p2, seed + p2, seed, seed - p1 } {}
+
+  void update(void const *data, size_t size) {
+    auto p = (unsigned char const *)data;
+    total += size;
+    if (buffered) {
+      size_t n = std::min(size, sizeof buffer - buffered);
+      memcpy(buffer + buffered, p, n);
+      buffered += n;
+      p += n;
+      size -= n;
+      if (buffered < sizeof buffer) return;
+      consume(buffer);
+      buffered = 0;
+    }
+    for (; size >= 32; p += 32, size -= 32) consume(p);
+    memcpy(buffer, p, size);
+    buffered = size;
+  }
+
+  uint64_t digest() const {
+    uint64_t h;
+    if (total >= 32) {
+      h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+      for (auto x : v) h = merge(h, x);
+    } else {
+      h = v[2] + p5;
+    }
+    h += total;
+    auto p = buffer, end = buffer + buffered;
+    for (; p + 8 <= end; p += 8) h = rotl(h ^ round(0, read64(p)), 27) * p1 + p4;
+    if (p + 4 <= end) {
+      h = rotl(h ^ (read32(p) * p1), 23) * p2 + p3;
+      p += 4;
+    }
+    for (; p < end; p++) h = rotl(h ^ (*p * p5), 11) * p1;
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+    return h;
+  }
+};
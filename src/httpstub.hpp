@@ -0,0 +1,122 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <mutex>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <strings.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#include "decompress.hpp"
+#include "writers.hpp"
+
+struct http_stub_options {
+  // Accept-Ranges: bytes in every response
+  bool advertise_ranges = true;
+  // 206 with the requested slice; off answers with the whole body like a mirror that ignores Range
+  bool honor_ranges = true;
+};
+
+namespace http_stub_detail {
+
+inline void serve(std::filesystem::path const &dir, int fd, http_stub_options options, FILE *log, std::mutex &log_mtx) {
+  std::string request;
+  char buf[4096];
+  while (request.find("\r\n\r\n") == std::string::npos) {
+    auto ret = recv(fd, buf, sizeof buf, 0);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0 || request.size() > 16384) return;
+    request.append(buf, ret);
+  }
+  auto method = request.substr(0, request.find(' '));
+  auto target = request.substr(method.size() + 1, request.find(' ', method.size() + 1) - method.size() - 1);
+  // only plain names are served, a stub has no business resolving paths
+  auto name = target.substr(target.rfind('/') + 1);
+  int file  = name.empty() || name[0] == '.' ? -1 : ::open((dir / name).c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (file < 0 || fstat(file, &st) != 0) {
+    if (file >= 0) close(file);
+    std::string response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    write_fd(fd, response.data(), response.size());
+    return;
+  }
+  guard file_guard{ [&] { close(file); } };
+  uint64_t begin = 0, end = st.st_size;
+  bool partial   = false;
+  for (auto pos = request.find("\r\n"); pos != std::string::npos; pos = request.find("\r\n", pos + 2)) {
+    unsigned long long first, last;
+    if (strncasecmp(request.c_str() + pos + 2, "range: bytes=", 13) != 0) continue;
+    if (sscanf(request.c_str() + pos + 15, "%llu-%llu", &first, &last) == 2 && first <= last && last < (uint64_t)st.st_size && options.honor_ranges) {
+      begin   = first;
+      end     = last + 1;
+      partial = true;
+    }
+  }
+  std::string response = partial ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n";
+  response += "Content-Length: " + std::to_string(end - begin) + "\r\n";
+  if (partial) response += "Content-Range: bytes " + std::to_string(begin) + "-" + std::to_string(end - 1) + "/" + std::to_string(st.st_size) + "\r\n";
+  if (options.advertise_ranges) response += "Accept-Ranges: bytes\r\n";
+  response += "Connection: close\r\n\r\n";
+  {
+    std::lock_guard lock{ log_mtx };
+    fprintf(log, "%s %s %d %llu-%llu\n", method.c_str(), name.c_str(), partial ? 206 : 200, (unsigned long long)begin, (unsigned long long)end);
+    fflush(log);
+  }
+  try {
+    write_fd(fd, response.data(), response.size());
+  } catch (std::exception &) {
+    return;
+  }
+  if (method != "GET") return;
+  off_t offset = begin;
+  while ((uint64_t)offset < end) {
+    auto ret = sendfile(fd, file, &offset, end - offset);
+    if (ret < 0 && errno == EINTR) continue;
+    // the client hung up, as installs do once they spot a bad response
+    if (ret <= 0) return;
+  }
+}
+
+} // namespace http_stub_detail
+
+// Minimal HTTP/1.1 server for the files directly inside dir, to exercise downloads without the network.
+// GET and HEAD only, one thread per connection; every response is logged to log_file as
+// "<method> <name> <status> <begin>-<end>". Runs in a forked child that ends with its parent.
+inline pid_t spawn_http_stub(std::filesystem::path const &dir, int listener, http_stub_options options, std::filesystem::path const &log_file) {
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  // clients hanging up mid-body must not take the whole stub down
+  signal(SIGPIPE, SIG_IGN);
+  static std::mutex log_mtx;
+  FILE *log = fopen(log_file.c_str(), "a");
+  if (!log) _exit(1);
+  while (true) {
+    int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        // the listener is shared with a non-blocking parent
+        pollfd pfd{ listener, POLLIN, 0 };
+        ::poll(&pfd, 1, -1);
+        continue;
+      }
+      // a client that gave up before the accept, as cancelled range transfers do
+      if (errno == ECONNABORTED) continue;
+      _exit(1);
+    }
+    std::thread{ [=] {
+      http_stub_detail::serve(dir, fd, options, log, log_mtx);
+      close(fd);
+    } }.detach();
+  }
+}
@@ -0,0 +1,369 @@
+#pragma once
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <ctime>
+#include <errno.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <limits>
+#include <regex.h>
+#include <stdexcept>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+#include "bundle.hpp"
+#include "decompress.hpp"
+#include "writers.hpp"
+
+// Time of a line starting with a "YYYY-MM-DD HH:MM:SS" stamp (T also separates, colour codes and an opening
+// bracket may precede it), -1 for lines without one. Parsed in place, lines are never copied.
+inline time_t line_time(char const *p, char const *end) {
+  for (int skip = 0; p < end && skip < 16; skip++) {
+    if (*p == '\033') {
+      while (p < end && *p != 'm') p++;
+      p++;
+    } else if (*p == '[' || *p == ' ' || *p == '\0') {
+      p++;
+    } else {
+      break;
+    }
+  }
+  if (end - p < 19) return -1;
+  static char const shape[] = "dddd-dd-dd dd:dd:dd";
+  for (int i = 0; i < 19; i++) {
+    if (shape[i] == 'd' ? !isdigit(p[i]) : (i == 10 ? p[i] != ' ' && p[i] != 'T' : p[i] != shape[i])) return -1;
+  }
+  auto num = [&](int at, int len) {
+    int ret = 0;
+    for (int i = 0; i < len; i++) ret = ret * 10 + (p[at + i] - '0');
+    return ret;
+  };
+  // mktime dominates a scan, consecutive lines almost always share the hour so it is resolved once per hour
+  thread_local char hour[13] = {};
+  thread_local time_t hour_start;
+  if (memcmp(hour, p, 13) != 0) {
+    tm parts{};
+    parts.tm_year  = num(0, 4) - 1900;
+    parts.tm_mon   = num(5, 2) - 1;
+    parts.tm_mday  = num(8, 2);
+    parts.tm_hour  = num(11, 2);
+    parts.tm_isdst = -1;
+    hour_start     = mktime(&parts);
+    memcpy(hour, p, 13);
+  }
+  return hour_start + num(14, 2) * 60 + num(17, 2);
+}
+
+// an age like 90s, 30m, 12h or 7d in seconds, -1 when text is not one
+inline long parse_age_arg(std::string const &text) {
+  if (text.size() < 2 || !strchr("smhd", text.back()) || !std::all_of(text.begin(), text.end() - 1, isdigit)) return -1;
+  auto unit  = text.back();
+  long scale = unit == 's' ? 1 : unit == 'm' ? 60 : unit == 'h' ? 3600 : 86400;
+  return std::stol(text.substr(0, text.size() - 1)) * scale;
+}
+
+// --since/--until: a date with an optional time, epoch seconds, or an age
+inline time_t parse_time_arg(std::string const &text) {
+  if (text.empty()) throw std::runtime_error("Empty time");
+  if (auto age = parse_age_arg(text); age >= 0) return time(nullptr) - age;
+  if (std::all_of(text.begin(), text.end(), isdigit)) return std::stoll(text);
+  auto full = text;
+  if (full.size() == 10) full += " 00:00:00";
+  if (full.size() == 16) full += ":00";
+  auto ret = line_time(full.data(), full.data() + full.size());
+  if (ret < 0) throw std::runtime_error("Invalid time: " + text);
+  return ret;
+}
+
+// When stone.log is due for rotation as start applies it before every launch; logs --rotate takes its own limits
+struct log_rotation {
+  uint64_t max_size            = 64 << 20;
+  std::chrono::seconds max_age = std::chrono::hours(24);
+  size_t keep                  = 90;
+};
+
+inline log_rotation &rotation_settings() {
+  static log_rotation val;
+  return val;
+}
+
+// One gzip member per block, so a query can start decompressing at any block boundary
+struct log_block {
+  time_t time;
+  uint64_t offset, packed_offset;
+};
+
+struct log_segment {
+  std::filesystem::path file;
+  time_t begin, end;
+  std::vector<log_block> blocks;
+};
+
+// Rotated logs of one service. stone.log stays the file nsgod writes; rotation copies it into
+// logs/<begin>-<end>.log.gz and truncates it, with a sparse time -> offset index next to each segment.
+class log_store {
+  std::filesystem::path live, dir;
+
+  static constexpr size_t block_size = 1 << 20;
+
+  std::filesystem::path index_of(std::filesystem::path file) const { return file.replace_extension().replace_extension(".idx"); }
+
+  time_t current_begin() const {
+    FILE *fp       = fopen((dir / "current").c_str(), "r");
+    long long time = 0;
+    if (fp) {
+      if (fscanf(fp, "%lld", &time) != 1) time = 0;
+      fclose(fp);
+    }
+    return time;
+  }
+
+  void set_current_begin(time_t time) {
+    auto temp = dir / "current.tmp";
+    FILE *fp  = fopen(temp.c_str(), "w");
+    if (!fp) throw std::runtime_error("Failed to write " + temp.string());
+    fprintf(fp, "%lld\n", (long long)time);
+    fclose(fp);
+    std::filesystem::rename(temp, dir / "current");
+  }
+
+  static void deflate_member(z_stream &zs, char const *data, size_t size, std::string &out) {
+    deflateReset(&zs);
+    zs.next_in  = (Bytef *)data;
+    zs.avail_in = size;
+    out.resize(deflateBound(&zs, size) + 32);
+    zs.next_out  = (Bytef *)out.data();
+    zs.avail_out = out.size();
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) throw std::runtime_error("Failed to compress log block");
+    out.resize(out.size() - zs.avail_out);
+  }
+
+public:
+  log_store(std::filesystem::path const &service)
+      : live(service / "stone.log")
+      , dir(service / "logs") {}
+
+  std::vector<log_segment> segments() const {
+    std::vector<log_segment> ret;
+    std::error_code ec;
+    for (auto &item : std::filesystem::directory_iterator(dir, ec)) {
+      if (item.path().extension() != ".idx") continue;
+      FILE *fp = fopen(item.path().c_str(), "r");
+      if (!fp) continue;
+      log_segment segment{ std::filesystem::path(item.path()).replace_extension(".log.gz"), 0, 0, {} };
+      long long begin, end, time;
+      uint64_t offset, packed;
+      if (fscanf(fp, "%lld %lld", &begin, &end) == 2) {
+        segment.begin = begin;
+        segment.end   = end;
+        while (fscanf(fp, "%lld %" SCNu64 " %" SCNu64, &time, &offset, &packed) == 3) segment.blocks.push_back({ (time_t)time, offset, packed });
+        if (!segment.blocks.empty()) ret.push_back(std::move(segment));
+      }
+      fclose(fp);
+    }
+    std::sort(ret.begin(), ret.end(), [](auto &a, auto &b) { return a.begin < b.begin; });
+    return ret;
+  }
+
+  // Moves stone.log into a compressed segment once it is larger than max_size or older than max_age, then keeps
+  // the newest keep segments. nsgod holds stone.log open, so it is copied and truncated in place.
+  bool rotate(uint64_t max_size, std::chrono::seconds max_age, size_t keep, bool force = false) {
+    using namespace std::filesystem;
+    create_directories(dir);
+    int fd = ::open(live.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) return false;
+    guard fd_guard{ [&] { close(fd); } };
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) return false;
+    time_t now = time(nullptr), begin = current_begin();
+    if (!force && (uint64_t)st.st_size < max_size && (begin == 0 || now - begin < max_age.count())) {
+      if (begin == 0) set_current_begin(now);
+      return false;
+    }
+    auto temp = dir / "segment.tmp";
+    int out   = ::open(temp.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) throw std::runtime_error("Failed to create " + temp.string() + ": " + strerror(errno));
+    guard out_guard{ [&] { close(out); } };
+    z_stream zs{};
+    if (deflateInit2(&zs, 6, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) throw std::runtime_error("zlib stream init failed");
+    guard zs_guard{ [&] { deflateEnd(&zs); } };
+    std::vector<log_block> blocks;
+    std::string block, packed;
+    uint64_t offset = 0, packed_offset = 0, size = st.st_size;
+    auto emit = [&](size_t length) {
+      time_t stamp = -1;
+      // a writer without O_APPEND keeps its offset across the truncate and leaves a hole of zeros
+      size_t start = 0;
+      while (start < length && block[start] == '\0') start++;
+      for (size_t pos = start; pos < length && stamp < 0;) {
+        auto nl = (char const *)memchr(block.data() + pos, '\n', length - pos);
+        auto le = nl ? nl - block.data() : length;
+        stamp   = line_time(block.data() + pos, block.data() + le);
+        pos     = le + 1;
+      }
+      deflate_member(zs, block.data() + start, length - start, packed);
+      write_fd(out, packed.data(), packed.size());
+      blocks.push_back({ stamp, offset, packed_offset });
+      offset += length - start;
+      packed_offset += packed.size();
+      block.erase(0, length);
+    };
+    // copy until caught up with the writer, the lines written between the last read and the truncate are the only loss
+    for (uint64_t read_at = 0; read_at < size;) {
+      char buffer[65536];
+      auto got = pread(fd, buffer, std::min<uint64_t>(sizeof buffer, size - read_at), read_at);
+      if (got < 0 && errno == EINTR) continue;
+      if (got <= 0) break;
+      block.append(buffer, got);
+      read_at += got;
+      while (block.size() >= block_size) {
+        // blocks end on a line boundary so every block starts with a whole line
+        auto nl = block.rfind('\n', block_size);
+        emit(nl == std::string::npos ? block_size : nl + 1);
+      }
+      if (read_at == size && fstat(fd, &st) == 0 && (uint64_t)st.st_size > size) size = st.st_size;
+    }
+    if (ftruncate(fd, 0) != 0) throw std::runtime_error("Failed to truncate " + live.string() + ": " + strerror(errno));
+    if (!block.empty()) emit(block.size());
+    // a log that was never rotated starts at its first stamped line
+    if (begin == 0) {
+      begin = now;
+      for (auto &item : blocks)
+        if (item.time >= 0) begin = std::min(begin, item.time);
+    }
+    // blocks without a stamped line get a time interpolated between the segment bounds
+    time_t previous = begin;
+    for (auto &item : blocks) {
+      if (item.time < 0) item.time = std::max(previous, (time_t)(begin + (now - begin) * (double)item.offset / std::max<uint64_t>(offset, 1)));
+      previous = item.time;
+    }
+    if (fsync(out) != 0) throw std::runtime_error("Failed to write " + temp.string() + ": " + strerror(errno));
+    auto name = std::to_string(begin) + "-" + std::to_string(now);
+    rename(temp, dir / (name + ".log.gz"));
+    auto index_temp = dir / (name + ".idx.tmp");
+    FILE *fp        = fopen(index_temp.c_str(), "w");
+    if (!fp) throw std::runtime_error("Failed to write " + index_temp.string());
+    fprintf(fp, "%lld %lld\n", (long long)begin, (long long)now);
+    for (auto &item : blocks) fprintf(fp, "%lld %" PRIu64 " %" PRIu64 "\n", (long long)item.time, item.offset, item.packed_offset);
+    fclose(fp);
+    // a segment becomes visible to queries once its index exists
+    rename(index_temp, dir / (name + ".idx"));
+    set_current_begin(now);
+    auto all = segments();
+    for (size_t i = 0; i + keep < all.size(); i++) {
+      std::error_code ec;
+      remove(index_of(all[i].file), ec);
+      remove(all[i].file, ec);
+    }
+    return true;
+  }
+
+  // Writes the lines between since and until (inclusive, 0 for open ends) that match grep to out.
+  // Only segments overlapping the range are mapped and only their blocks inside it are decompressed;
+  // the live log is searched with a bisection on the line stamps.
+  template <typename F> void query(time_t since, time_t until, regex_t const *grep, F out) const {
+    if (until == 0) until = std::numeric_limits<time_t>::max();
+    time_t current = 0;
+    auto line = [&](char const *p, char const *end) {
+      while (p < end && *p == '\0') p++;
+      if (auto stamp = line_time(p, end); stamp >= 0) current = stamp;
+      if (current < since || current > until) return;
+      if (grep) {
+        regmatch_t match{ 0, (regoff_t)(end - p) };
+        if (regexec(grep, p, 1, &match, REG_STARTEND) != 0) return;
+      }
+      out(p, end - p + 1);
+    };
+    std::string carry;
+    auto split = [&](char const *data, size_t size) {
+      auto end = data + size;
+      while (data < end) {
+        auto nl = (char const *)memchr(data, '\n', end - data);
+        if (!nl) {
+          carry.append(data, end);
+          return;
+        }
+        if (carry.empty()) {
+          line(data, nl);
+        } else {
+          carry.append(data, nl + 1);
+          line(carry.data(), carry.data() + carry.size() - 1);
+          carry.clear();
+        }
+        data = nl + 1;
+      }
+    };
+    for (auto &segment : segments()) {
+      if (segment.end < since || segment.begin > until) continue;
+      auto &blocks = segment.blocks;
+      // the last block starting at or before since, up to the first one starting after until
+      auto first = std::upper_bound(blocks.begin(), blocks.end(), since, [](time_t t, log_block const &b) { return t < b.time; });
+      if (first != blocks.begin()) --first;
+      auto last = std::upper_bound(first, blocks.end(), until, [](time_t t, log_block const &b) { return t < b.time; });
+      if (first == last) continue;
+      mapped_file map{ segment.file };
+      uint64_t from = first->packed_offset, to = last == blocks.end() ? map.size() : last->packed_offset;
+      if (to > map.size() || from > to) throw std::runtime_error("Log segment " + segment.file.string() + " does not match its index");
+      current = first->time;
+      decompressor inflater;
+      inflater.push(map.data() + from, to - from, split);
+      if (!carry.empty()) {
+        carry += '\n';
+        line(carry.data(), carry.data() + carry.size() - 1);
+        carry.clear();
+      }
+    }
+    if (until < current_begin()) return;
+    std::error_code ec;
+    if (!std::filesystem::exists(live, ec) || std::filesystem::file_size(live, ec) == 0) return;
+    mapped_file map{ live };
+    auto data = map.data(), end = data + map.size();
+    auto line_start = [&](char const *p) {
+      while (p > data && p[-1] != '\n') p--;
+      return p;
+    };
+    char const *pos = data;
+    if (since) {
+      // first line stamped at or after since, lines without a stamp stay with the stamped line above them
+      char const *low = data, *high = end;
+      while (high - low > 4096) {
+        auto mid   = line_start(low + (high - low) / 2);
+        auto probe = mid;
+        time_t stamp = -1;
+        for (int i = 0; i < 64 && probe < high && stamp < 0; i++) {
+          auto nl = (char const *)memchr(probe, '\n', end - probe);
+          stamp   = line_time(probe, nl ? nl : end);
+          probe   = nl ? nl + 1 : end;
+        }
+        if (stamp >= 0 && stamp < since)
+          low = probe;
+        else
+          high = mid;
+      }
+      pos = line_start(low);
+    }
+    current = 0;
+    while (pos < end) {
+      auto nl = (char const *)memchr(pos, '\n', end - pos);
+      if (!nl) {
+        std::string tail(pos, end);
+        tail += '\n';
+        line(tail.data(), tail.data() + tail.size() - 1);
+        break;
+      }
+      line(pos, nl);
+      if (current > until) break;
+      pos = nl + 1;
+    }
+  }
+};
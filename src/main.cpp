@@ -2,20 +2,31 @@
 #include <CLI/CLI.hpp>
 #include <condition_variable>
 #include <curl/curl.h>
+#include <deque>
 #include <editline.h>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <mutex>
+#include <poll.h>
+#include <random>
 #include <rpcws.hpp>
 #include <signal.h>
 #include <sys/ioctl.h>
 #include <termios.h>
 #include <thread>
+#include <unordered_set>
 
 #include <stone-api/Chat.h>
 #include <stone-api/Command.h>
 #include <stone-api/Core.h>
 
+#include "backup.hpp"
+#include "bench.hpp"
+#include "httpstub.hpp"
+#include "logstore.hpp"
+#include "metrics.hpp"
+#include "prewarm.hpp"
 #include "utils.hpp"
 
 using namespace rpcws;
@@ -28,6 +39,24 @@ RPC::Client &nsgod() {
   return client;
 }
 
+// connecting to the daemon is part of its --timing cost, on top of whatever start_nsgod spent reaching it
+promise<void> connect_nsgod() {
+  auto began = std::chrono::steady_clock::now();
+  return nsgod().start().then([began] {
+    timing().daemon += std::chrono::steady_clock::now() - began;
+    timing().reached = true;
+  });
+}
+
+// every request to the daemon goes through here, so --timing can account for it
+promise<json> call_nsgod(std::string const &method, json params) {
+  auto began = std::chrono::steady_clock::now();
+  return nsgod().call(method, std::move(params)).then<json>([method, began](json ret) {
+    timing().record_rpc(method, std::chrono::steady_clock::now() - began);
+    return ret;
+  });
+}
+
 template <typename F> void handle_fail(F f) {
   try {
     f();
@@ -66,13 +95,46 @@ const auto service_name_validator = CLI::Validator(
 
 namespace fs = std::filesystem;
 
+ProcessLaunchOptions launch_options(std::string const &service) {
+  using namespace std::chrono;
+  return {
+    .waitstop = true,
+    .pty = true,
+    .root = fs::absolute(".stone/core"),
+    .cwd = "/run",
+    .log = fs::absolute(fs::path(service) / "stone.log"),
+    .cmdline = { "./stone" },
+    .env = { "STONE_DEBUG=1", "UPSTART_JOB=stoneserver", "HOME=/run/data", },
+    .mounts = {
+      {"run/game", fs::absolute(".stone/game")},
+      {"run/data", fs::absolute(service)},
+      {"dev", "/dev"},
+      {"proc", "/proc"},
+      {"tmp", "/tmp"},
+    },
+    .restart = RestartPolicy{
+      .enabled = true,
+      .max = 5,
+      .reset_timer = 1min,
+    },
+  };
+}
+
 int main(int argc, char **argv) {
   using namespace std::chrono;
+  timing().began = steady_clock::now();
+  std::atexit([] {
+    if (timing().enabled) print_timing();
+  });
   CLI::App app{ "stoneserver manager" };
   app.set_help_all_flag("--help-all");
+  app.add_flag("--timing", timing().enabled, "print daemon, rpc and total latency of the command to stderr");
   app.require_subcommand(-1);
   app.require_subcommand(1);
   auto check = app.add_subcommand("check", "check current installation");
+  check->add_flag("--verify", "check-verify"_flag, "compare every installed file with the manifest recorded at install time");
+  static unsigned check_jobs = 0;
+  check->add_option("--jobs", check_jobs, "hashing threads for --verify (default: one per core)");
   check->callback([] {
     fs::path base{ ".stone" };
     if (!fs::is_directory(base)) {
@@ -91,18 +153,85 @@ int main(int argc, char **argv) {
       std::cerr << "Minecraft (bedrock edition) is not installed" << std::endl;
       exit(EXIT_FAILURE);
     }
-    std::cout << "Seems all components is installed" << std::endl;
+    if (!"check-verify"_flag) {
+      std::cout << "Seems all components is installed" << std::endl;
+      return;
+    }
+    bool clean = true;
+    for (auto name : { "core", "game" }) {
+      auto began    = steady_clock::now();
+      auto expected = read_manifest(base / (std::string(name) + ".manifest"));
+      if (expected.empty()) {
+        std::cerr << name << ": no manifest recorded, reinstall to enable verification" << std::endl;
+        clean = false;
+        continue;
+      }
+      auto report  = verify_tree(base / name, expected, check_jobs ? check_jobs : std::thread::hardware_concurrency());
+      auto seconds = duration<double>(steady_clock::now() - began).count();
+      std::cout << name << ": " << report.files << " file(s), " << report.bytes / 1048576 << " MiB hashed in " << (int)(seconds * 1000) << "ms ("
+                << (int)(report.bytes / 1048576 / std::max(seconds, 1e-3)) << " MiB/s)" << std::endl;
+      auto list = [&](char const *kind, std::vector<std::string> const &paths) {
+        for (auto &path : paths) std::cerr << name << ": " << kind << " " << path << std::endl;
+      };
+      list("missing", report.missing);
+      list("extra", report.extra);
+      list("modified", report.modified);
+      if (!report.clean()) clean = false;
+    }
+    if (!clean) exit(EXIT_FAILURE);
+    std::cout << "All components match their manifests" << std::endl;
   });
   auto install = app.add_subcommand("install", "install stoneserver");
   static std::vector<components> install_components;
-  install->add_option("components", install_components, "install components")
-      ->transform(CLI::Transformer(std::map<std::string, components>{
-          { "core", components::core },
-          { "game", components::game },
-          { "nsgod", components::nsgod },
-      }));
-  install->callback([] {
+  // upgrade installs the same way
+  auto install_options = [](CLI::App *sub) {
+    sub->add_option("components", install_components, "install components")
+        ->transform(CLI::Transformer(std::map<std::string, components>{
+            { "core", components::core },
+            { "game", components::game },
+            { "nsgod", components::nsgod },
+        }));
+    sub->add_flag("--stream,!--no-stream", install_settings().stream, "extract while downloading instead of buffering the whole archive");
+    sub->add_option("--buffer-size", install_settings().buffer_size, "streaming buffer size in bytes")->check(CLI::Range(1024, 512 * 1024));
+    sub->add_option("--jobs", install_settings().jobs, "number of extraction workers")->check(CLI::Range(1, 16));
+    sub->add_option("--segments", install_settings().segments, "parallel range requests per component (streaming mode)")->check(CLI::Range(1, 16));
+    sub->add_option("--writers", install_settings().writers, "file writer threads per extraction, 0 writes inline")->check(CLI::Range(0, 32));
+    sub->add_flag("--cache,!--no-cache", install_settings().cache, "reuse previously downloaded archives (streaming mode)");
+    sub->add_option("--cache-dir", install_settings().cache_dir, "download cache directory, may be shared between installs");
+    sub->add_option("--sha256", install_settings().sha256, "expected sha256 of a component's archive, as name=hex");
+    sub->add_option("--checksums", install_settings().checksums, "sha256sum style file or url with the expected digests of the archives");
+    sub->add_option("--from", install_settings().from, "install from a bundle, an archive or a mirror directory without the network")
+        ->check(CLI::ExistingPath);
+    sub->add_option("--mirror", install_settings().mirror, "base url serving the components as <url>/core, <url>/game and <url>/nsgod");
+    sub->add_option("--keep-versions", install_settings().keep_versions, "installed versions of core and game to keep, including the current one")
+        ->check(CLI::Range(1, 16));
+  };
+  install_options(install);
+  static auto run_install = [] {
+    if (!install_settings().from.empty()) try {
+        local_artifacts() = find_local_artifacts(install_settings().from);
+        if (install_components.empty())
+          for (auto &[name, artifact] : local_artifacts()) {
+            if (name == "core") install_components.emplace_back(components::core);
+            if (name == "game") install_components.emplace_back(components::game);
+            if (name == "nsgod") install_components.emplace_back(components::nsgod);
+          }
+      } catch (std::exception &ex) {
+        std::cerr << ex.what() << std::endl;
+        exit(EXIT_FAILURE);
+      }
+    else if (install_settings().stream && install_settings().cache) try {
+        install_cache() = std::make_unique<download_cache>(install_settings().cache_dir);
+      } catch (std::exception &ex) {
+        std::cerr << "Download cache disabled: " << ex.what() << std::endl;
+      }
     curl_global_init(CURL_GLOBAL_ALL);
+    try {
+      load_expected_digests();
+    } catch (std::exception &ex) {
+      std::cerr << ex.what() << std::endl;
+      exit(EXIT_FAILURE);
+    }
     CURLM *cm = curl_multi_init();
     curl_multi_setopt(cm, CURLMOPT_MAXCONNECTS, (long)10);
     if (install_components.size() == 0) {
@@ -110,13 +239,19 @@ int main(int argc, char **argv) {
       install_components.emplace_back(components::game);
       install_components.emplace_back(components::nsgod);
     }
+    worker_pool pool{ install_settings().jobs };
     for (components comp : install_components) {
       switch (comp) {
-      case components::core: components_info<components::core>::add_transfer(cm); break;
-      case components::game: components_info<components::game>::add_transfer(cm); break;
-      case components::nsgod: components_info<components::nsgod>::add_transfer(cm); break;
+      case components::core: components_info<components::core>::add_transfer(cm, pool); break;
+      case components::game: components_info<components::game>::add_transfer(cm, pool); break;
+      case components::nsgod: components_info<components::nsgod>::add_transfer(cm, pool); break;
       }
     }
+    auto poll_all = [] {
+      components_info<components::core>::poll();
+      components_info<components::game>::poll();
+      components_info<components::nsgod>::poll();
+    };
     int still_alive = 1;
     int msgs_left   = -1;
     do {
@@ -125,72 +260,348 @@ int main(int argc, char **argv) {
       while ((msg = curl_multi_info_read(cm, &msgs_left))) {
         if (msg->msg == CURLMSG_DONE) {
           CURL *e = msg->easy_handle;
-          components *pcomp;
-          curl_easy_getinfo(e, CURLINFO_PRIVATE, &pcomp);
+          transfer *tag;
+          curl_easy_getinfo(e, CURLINFO_PRIVATE, &tag);
+          auto result = msg->data.result;
           curl_multi_remove_handle(cm, e);
-          curl_easy_cleanup(e);
-          switch (*pcomp) {
-          case components::core: components_info<components::core>::extract(msg->data.result); break;
-          case components::game: components_info<components::game>::extract(msg->data.result); break;
-          case components::nsgod: components_info<components::nsgod>::extract(msg->data.result); break;
+          switch (tag->comp) {
+          case components::core: components_info<components::core>::transfer_done(*tag, e, result, cm, pool); break;
+          case components::game: components_info<components::game>::transfer_done(*tag, e, result, cm, pool); break;
+          case components::nsgod: components_info<components::nsgod>::transfer_done(*tag, e, result, cm, pool); break;
           }
+          curl_easy_cleanup(e);
         } else {
           std::cerr << msg->msg << std::endl;
         }
       }
-      if (still_alive) curl_multi_wait(cm, NULL, 0, 1000, NULL);
-    } while (still_alive);
+      poll_all();
+      update_progress();
+      if (still_alive || pool.busy()) {
+        // extraction runs on the pool, the eventfd wakes us up to resume throttled transfers or report progress
+        curl_waitfd wfd{ notify_fd(), CURL_WAIT_POLLIN, 0 };
+        curl_multi_wait(cm, &wfd, 1, 1000, NULL);
+        notify_reset();
+      }
+    } while (still_alive || pool.busy());
+    poll_all();
     curl_multi_cleanup(cm);
     curl_global_cleanup();
+  };
+  install->callback(run_install);
+  auto upgrade = app.add_subcommand("upgrade", "install new versions, then restart running services onto them in batches");
+  static size_t upgrade_concurrency = 1;
+  static unsigned upgrade_timeout   = 300;
+  install_options(upgrade);
+  upgrade->add_option("--concurrency", upgrade_concurrency, "services restarted at the same time")->check(CLI::Range(1, 64));
+  upgrade->add_option("--timeout", upgrade_timeout, "seconds a service may take to come back before the upgrade is aborted")->check(CLI::Range(1u, 86400u));
+  upgrade->callback([] {
+    run_install();
+    bool failed = false, changed = false;
+    for (components comp : install_components) {
+      switch (comp) {
+      case components::core:
+        failed |= components_info<components::core>::stage() == install_stage::failed;
+        changed |= components_info<components::core>::changed();
+        break;
+      case components::game:
+        failed |= components_info<components::game>::stage() == install_stage::failed;
+        changed |= components_info<components::game>::changed();
+        break;
+      case components::nsgod:
+        failed |= components_info<components::nsgod>::stage() == install_stage::failed;
+        if (components_info<components::nsgod>::changed()) std::cout << "nsgod was updated, it takes effect once the daemon is restarted" << std::endl;
+        break;
+      }
+    }
+    if (failed) {
+      std::cerr << "Upgrade failed, running services were left alone" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (!changed || !fs::exists(".stone/nsgod.socket")) {
+      std::cout << "Nothing to restart" << std::endl;
+      return;
+    }
+    // services are restarted through nsgod, which resolves .stone/core and .stone/game to the new versions on launch
+    static std::deque<std::string> pending;
+    static std::map<std::string, steady_clock::time_point> restarting;
+    static size_t total = 0, restarted = 0;
+    static auto launch = [] {
+      while (restarting.size() < upgrade_concurrency && !pending.empty()) {
+        auto service = pending.front();
+        pending.pop_front();
+        restarting[service] = steady_clock::now();
+        call_nsgod("kill", json::object({
+                               { "service", service },
+                               { "signal", SIGTERM },
+                               { "restart", 1 },
+                           }))
+            .then([](json ret) {})
+            .fail(handle_fail<std::exception_ptr>);
+      }
+      if (restarting.empty()) ep->shutdown();
+    };
+    handle_fail([] {
+      connect_nsgod()
+          .then<promise<json>>([] { return call_nsgod("status", json::object({})); })
+          .then([](json ret) {
+            for (auto [k, v] : ret.items())
+              if (v["status"] == "running") pending.push_back(k);
+            total = pending.size();
+            nsgod().on("started", [](json data) {
+              auto it = restarting.find(data["service"].get<std::string>());
+              if (it == restarting.end()) return;
+              auto elapsed = duration_cast<milliseconds>(steady_clock::now() - it->second).count();
+              restarting.erase(it);
+              std::cout << data["service"].get<std::string>() << " restarted in " << elapsed << "ms (" << ++restarted << "/" << total << ")" << std::endl;
+              launch();
+            });
+            // a service that does not come back stops the rollout, the rest stay on the version they run
+            static int timer = make_timer(1s, true);
+            ep->add(EPOLLIN, timer, ep->reg([](epoll_event const &) {
+              uint64_t expirations;
+              if (read(timer, &expirations, sizeof expirations) <= 0) return;
+              auto limit = steady_clock::now() - seconds(upgrade_timeout);
+              if (std::none_of(restarting.begin(), restarting.end(), [&](auto &item) { return item.second < limit; })) return;
+              std::cerr << "Timed out waiting for:";
+              for (auto &[service, since] : restarting) std::cerr << " " << service;
+              std::cerr << std::endl;
+              if (!pending.empty()) {
+                std::cerr << "Not restarted:";
+                for (auto &service : pending) std::cerr << " " << service;
+                std::cerr << std::endl;
+              }
+              exit(EXIT_FAILURE);
+            }));
+            launch();
+          })
+          .fail(handle_fail<std::exception_ptr>);
+    });
+    ep->wait();
+  });
+  auto bundle = app.add_subcommand("bundle", "pack component archives into one file for offline installs");
+  bundle->add_option("output", "bundle-output"_str, "bundle file to write")->required();
+  bundle->add_option("inputs", "bundle-inputs"_vstr, "archives, mirror directories or bundles, name=path names the component explicitly (default: the download cache)");
+  bundle->add_option("--cache-dir", install_settings().cache_dir, "download cache to take the archives from");
+  bundle->callback([] {
+    std::map<std::string, local_artifact> inputs;
+    try {
+      for (auto &input : "bundle-inputs"_vstr) {
+        auto eq = input.find('=');
+        if (eq != std::string::npos && !fs::exists(input)) {
+          fs::path file = input.substr(eq + 1);
+          inputs[input.substr(0, eq)] = { file, 0, fs::file_size(file), {} };
+          continue;
+        }
+        for (auto &[name, artifact] : find_local_artifacts(input)) inputs[name] = artifact;
+      }
+      if ("bundle-inputs"_vstr.empty()) {
+        download_cache cache{ install_settings().cache_dir };
+        auto add = [&](char const *name, char const *url) {
+          if (auto entry = cache.lookup(url)) inputs[name] = { cache.blob(entry->sha256), 0, fs::file_size(cache.blob(entry->sha256)), entry->sha256 };
+        };
+        add(components_info<components::core>::name(), components_info<components::core>::url());
+        add(components_info<components::game>::name(), components_info<components::game>::url());
+        add(components_info<components::nsgod>::name(), components_info<components::nsgod>::url());
+      }
+      if (inputs.empty()) throw std::runtime_error("Nothing to bundle");
+      auto index = write_bundle("bundle-output"_str, inputs);
+      for (auto &item : index["components"])
+        std::cout << item["name"].get<std::string>() << "\t" << item["size"] << "\t" << item["sha256"].get<std::string>() << std::endl;
+    } catch (std::exception &ex) {
+      std::cerr << ex.what() << std::endl;
+      exit(EXIT_FAILURE);
+    }
   });
-  auto start = app.add_subcommand("start", "start service");
-  start->add_option("service", "start-service"_str, "target service to start")->required()->check(CLI::ExistingDirectory & service_name_validator);
+  static unsigned prewarm_jobs            = 16;
+  static std::string prewarm_profile_file = ".stone/prewarm.profile";
+  // returns the recorded cold start time (0 without a profile) and how long the prewarm took, both in ms
+  static auto run_prewarm = [] {
+    auto began    = steady_clock::now();
+    auto profile  = read_prewarm_profile(prewarm_profile_file);
+    bool recorded = !profile.ranges.empty();
+    if (!recorded) profile = full_prewarm_profile(".stone", { "core", "game" });
+    auto stats   = prewarm(".stone", profile, prewarm_jobs);
+    auto elapsed = (long long)duration_cast<milliseconds>(steady_clock::now() - began).count();
+    std::cout << "Prewarmed " << stats.bytes / 1048576 << " MiB of " << stats.files << " file(s) in " << elapsed << "ms, " << stats.uncached / 1048576
+              << " MiB were not cached" << (recorded ? "" : " (no profile recorded, read the whole trees)") << std::endl;
+    if (stats.missing) std::cerr << stats.missing << " profiled file(s) are gone, record the profile again after an upgrade" << std::endl;
+    return std::make_pair(profile.cold_ms, elapsed);
+  };
+  auto prewarm_cmd = app.add_subcommand("prewarm", "read the installed core and game into the page cache ahead of a start");
+  static std::string prewarm_record;
+  static unsigned prewarm_settle = 5;
+  prewarm_cmd->add_option("--record", prewarm_record, "record the access profile from a cold start of this (stopped) service")
+      ->check(CLI::ExistingDirectory & service_name_validator);
+  prewarm_cmd->add_option("--settle", prewarm_settle, "seconds to keep recording after the service reported started");
+  prewarm_cmd->add_option("--jobs", prewarm_jobs, "reads in flight at once")->check(CLI::Range(1, 256));
+  prewarm_cmd->add_option("--profile", prewarm_profile_file, "access profile to prewarm by or to record");
+  prewarm_cmd->callback([] {
+    if (prewarm_record.empty()) {
+      auto [cold_ms, elapsed] = run_prewarm();
+      if (cold_ms) std::cout << "The recorded cold start took " << cold_ms << "ms, use start --prewarm --wait to measure the saving" << std::endl;
+      return;
+    }
+    start_nsgod(0);
+    if (auto remaining = evict_trees(".stone", { "core", "game" }))
+      std::cerr << remaining / 1048576 << " MiB stay cached (mapped by running services), the recorded start is only partly cold" << std::endl;
+    static residency_recorder recorder{ ".stone", { "core", "game" } };
+    recorder.sample();
+    static auto launched     = steady_clock::now();
+    static long long cold_ms = -1;
+    handle_fail([] {
+      connect_nsgod()
+          .then<promise<json>>([] {
+            nsgod().on("started", [](json data) {
+              if (data["service"].get<std::string>() != prewarm_record || cold_ms >= 0) return;
+              cold_ms = duration_cast<milliseconds>(steady_clock::now() - launched).count();
+              std::cout << prewarm_record << " started in " << cold_ms << "ms, recording " << prewarm_settle << "s more" << std::endl;
+              // lazily loaded resources still count, the profile covers what the first minutes of a server need
+              static int settle = make_timer(seconds(prewarm_settle));
+              ep->add(EPOLLIN, settle, ep->reg([](epoll_event const &) {
+                recorder.sample();
+                auto profile   = recorder.profile(cold_ms);
+                uint64_t bytes = 0;
+                for (auto &range : profile.ranges) bytes += range.length;
+                write_prewarm_profile(prewarm_profile_file, profile);
+                std::cout << "Recorded " << profile.ranges.size() << " range(s), " << bytes / 1048576 << " MiB to " << prewarm_profile_file << std::endl;
+                ep->shutdown();
+              }));
+            });
+            static int timer = make_timer(100ms, true);
+            ep->add(EPOLLIN, timer, ep->reg([](epoll_event const &) {
+              uint64_t expirations;
+              if (read(timer, &expirations, sizeof expirations) > 0) recorder.sample();
+            }));
+            launched = steady_clock::now();
+            return call_nsgod("start", json::object({
+                                           { "service", prewarm_record },
+                                           { "options", launch_options(prewarm_record) },
+                                       }));
+          })
+          .then([](json ret) { std::cout << prewarm_record << " launched from a cold cache" << std::endl; })
+          .fail(handle_fail<std::exception_ptr>);
+    });
+    ep->wait();
+  });
+  auto start = app.add_subcommand("start", "start service(s)");
+  static size_t start_parallel = 8;
+  static unsigned start_timeout = 0;
+  start->add_option("service", "start-service"_vstr, "target service(s) to start")->check(CLI::ExistingDirectory & service_name_validator)->expected(-1);
+  start->add_flag("--all", "start-all"_flag, "start every profile directory (holding worlds/ or stone.log) in the working directory");
   start->add_flag("--wait", "start-wait"_flag, "wait for started");
+  start->add_flag("--prewarm", "start-prewarm"_flag, "read the core and game into the page cache first, by the profile prewarm --record wrote");
+  start->add_option("--parallel", start_parallel, "start requests in flight at once")->check(CLI::Range(1, 256));
+  start->add_option("--timeout", start_timeout, "seconds to wait for started, 0 waits forever");
+  static bool start_rotate = true;
+  start->add_flag("--rotate,!--no-rotate", start_rotate, "rotate stone.log first when it is due (64M or a day old, see logs --rotate)");
   start->preparse_callback(start_nsgod);
   start->callback([] {
+    static std::deque<std::string> pending;
+    // launched services that have not reported back yet
+    static std::map<std::string, steady_clock::time_point> launched;
+    static size_t inflight = 0, total = 0, failed = 0;
+    static auto began = steady_clock::now();
+    // for the prewarm report: the recorded cold start, the prewarm itself and the slowest start this time
+    static long long cold_ms = 0, prewarm_ms = -1, slowest_ms = 0;
+    if ("start-all"_flag) {
+      std::vector<std::string> found;
+      for (auto &item : fs::directory_iterator(".")) {
+        auto name = item.path().filename().string();
+        if (!item.is_directory() || name[0] == '.' || name.find('.') != std::string::npos) continue;
+        // only directories a server has run in, not build trees or the output of dump and backup
+        std::error_code ec;
+        if (fs::is_directory(item.path() / "worlds", ec) || fs::exists(item.path() / "stone.log", ec)) found.push_back(name);
+      }
+      std::sort(found.begin(), found.end());
+      pending.assign(found.begin(), found.end());
+    } else {
+      pending.assign("start-service"_vstr.begin(), "start-service"_vstr.end());
+    }
+    if (pending.empty()) {
+      std::cerr << "No service to start" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    total = pending.size();
+    if ("start-prewarm"_flag) std::tie(cold_ms, prewarm_ms) = run_prewarm();
+    static auto finish = [] {
+      if (inflight || !pending.empty() || ("start-wait"_flag && !launched.empty())) return;
+      auto elapsed = duration_cast<milliseconds>(steady_clock::now() - began).count();
+      std::cout << total - failed << "/" << total << " service(s) " << ("start-wait"_flag ? "started" : "launched") << " in " << elapsed << "ms" << std::endl;
+      if (prewarm_ms >= 0 && cold_ms > 0) {
+        if ("start-wait"_flag)
+          std::cout << "Prewarm " << prewarm_ms << "ms + slowest start " << slowest_ms << "ms against a recorded cold start of " << cold_ms << "ms: "
+                    << cold_ms - prewarm_ms - slowest_ms << "ms saved" << std::endl;
+        else
+          std::cout << "The recorded cold start took " << cold_ms << "ms, add --wait to measure the saving" << std::endl;
+      }
+      ep->shutdown();
+      if (failed) exit(EXIT_FAILURE);
+    };
+    // every request goes over the one connection, at most start_parallel of them unanswered
+    static void (*launch)() = [] {
+      while (inflight < start_parallel && !pending.empty()) {
+        auto service = pending.front();
+        pending.pop_front();
+        inflight++;
+        // nsgod only ever appends to stone.log, a launch is where it gets rotated without a cron job
+        if (start_rotate) try {
+            auto &policy = rotation_settings();
+            log_store{ service }.rotate(policy.max_size, policy.max_age, policy.keep);
+          } catch (std::exception &ex) {
+            std::cerr << service << ": log rotation failed: " << ex.what() << std::endl;
+          }
+        launched[service] = steady_clock::now();
+        call_nsgod("start", json::object({
+                                { "service", service },
+                                { "options", launch_options(service) },
+                            }))
+            .then([service](json ret) {
+              inflight--;
+              if (!"start-wait"_flag) {
+                launched.erase(service);
+                std::cout << service << " launched" << std::endl;
+              }
+              launch();
+            })
+            .fail([service](std::exception_ptr e) {
+              try {
+                if (e) std::rethrow_exception(e);
+              } catch (std::exception &ex) {
+                std::cerr << service << ": " << ex.what() << std::endl;
+              }
+              inflight--;
+              failed++;
+              launched.erase(service);
+              launch();
+            });
+      }
+      finish();
+    };
     handle_fail([] {
-      nsgod()
-          .start()
-          .then<promise<json>>([] {
-            ProcessLaunchOptions options{
-              .waitstop = true,
-              .pty = true,
-              .root = fs::absolute(".stone/core"),
-              .cwd = "/run",
-              .log = fs::absolute(fs::path("start-service"_str) / "stone.log"),
-              .cmdline = { "./stone" },
-              .env = { "STONE_DEBUG=1", "UPSTART_JOB=stoneserver", "HOME=/run/data", },
-              .mounts = {
-                {"run/game", fs::absolute(".stone/game")},
-                {"run/data", fs::absolute("start-service"_str)},
-                {"dev", "/dev"},
-                {"proc", "/proc"},
-                {"tmp", "/tmp"},
-              },
-              .restart = RestartPolicy{
-                .enabled = true,
-                .max = 5,
-                .reset_timer = 1min,
-              },
-            };
+      connect_nsgod()
+          .then([] {
             if ("start-wait"_flag) {
               nsgod().on("started", [](json data) {
-                if (data["service"] == "start-service"_str) {
-                  std::cout << "start-service"_str
-                            << " started" << std::endl;
-                  ep->shutdown();
-                }
+                auto it = launched.find(data["service"].get<std::string>());
+                if (it == launched.end()) return;
+                long long elapsed = duration_cast<milliseconds>(steady_clock::now() - it->second).count();
+                slowest_ms        = std::max(slowest_ms, elapsed);
+                std::cout << it->first << " started in " << elapsed << "ms" << std::endl;
+                launched.erase(it);
+                finish();
               });
+              if (start_timeout) {
+                static int timer = make_timer(seconds(start_timeout));
+                ep->add(EPOLLIN, timer, ep->reg([](epoll_event const &) {
+                  std::cerr << "Timed out waiting for:";
+                  for (auto &[service, since] : launched) std::cerr << " " << service;
+                  for (auto &service : pending) std::cerr << " " << service;
+                  std::cerr << std::endl;
+                  exit(EXIT_FAILURE);
+                }));
+              }
             }
-            return nsgod().call("start", json::object({
-                                             { "service", "start-service"_str },
-                                             { "options", options },
-                                         }));
-          })
-          .then([](json ret) {
-            std::cout << "start-service"_str
-                      << " launched" << std::endl;
-            if (!"start-wait"_flag) ep->shutdown();
+            launch();
           })
           .fail(handle_fail<std::exception_ptr>);
     });
@@ -199,9 +610,8 @@ int main(int argc, char **argv) {
   auto ps = app.add_subcommand("ps", "list running services");
   ps->callback([] {
     handle_fail([] {
-      nsgod()
-          .start()
-          .then<promise<json>>([] { return nsgod().call("status", json::object({})); })
+      connect_nsgod()
+          .then<promise<json>>([] { return call_nsgod("status", json::object({})); })
           .then([](json ret) {
             for (auto [k, v] : ret.items()) { std::cout << k << "\t" << v["status"] << std::endl; }
             ep->shutdown();
@@ -210,23 +620,434 @@ int main(int argc, char **argv) {
     });
     ep->wait();
   });
+  auto top = app.add_subcommand("top", "live cpu, memory and io usage of services");
+  static double top_interval = 1;
+  static std::string top_sort = "cpu";
+  top->add_option("--interval", top_interval, "seconds between samples")->check(CLI::Range(0.1, 3600.0));
+  top->add_option("--sort", top_sort, "column to sort by")->check(CLI::IsMember(std::vector<std::string>{ "cpu", "rss", "io", "restarts", "name" }));
+  top->callback([] {
+    static service_monitor monitor;
+    // started and stopped events only mark the status stale; a start storm costs one status call on the next tick
+    static bool stale = false, refreshing = false;
+    static auto refresh = [] {
+      if (!stale || refreshing) return;
+      stale      = false;
+      refreshing = true;
+      call_nsgod("status", json::object({}))
+          .then([](json ret) {
+            refreshing = false;
+            monitor.apply_status(ret);
+          })
+          .fail(handle_fail<std::exception_ptr>);
+    };
+    static auto format_size = [](char *buf, size_t size, double bytes) {
+      static char const units[] = "BKMGT";
+      int unit = 0;
+      while (bytes >= 1024 && unit < 4) bytes /= 1024, unit++;
+      snprintf(buf, size, unit ? "%.1f%c" : "%.0f%c", bytes, units[unit]);
+      return buf;
+    };
+    static auto render = [] {
+      using row = service_monitor::service;
+      static std::vector<std::pair<std::string const *, row const *>> sorted;
+      static std::string out;
+      sorted.clear();
+      size_t processes = 0;
+      for (auto &[name, item] : monitor.services()) {
+        sorted.emplace_back(&name, &item);
+        processes += item.usage.processes;
+      }
+      auto key = [](row const *item) -> double {
+        if (top_sort == "cpu") return item->cpu;
+        if (top_sort == "rss") return item->usage.rss_bytes;
+        if (top_sort == "io") return item->io_rate;
+        return item->restarts;
+      };
+      std::stable_sort(sorted.begin(), sorted.end(), [&](auto &a, auto &b) { return top_sort != "name" && key(a.second) > key(b.second); });
+      char line[256], rss[16], io[16];
+      out = "\033[H\033[2J";
+      snprintf(line, sizeof line, "%zu service(s), %zu process(es), sampled in %ldus, sorted by %s\n\n", sorted.size(), processes,
+               (long)duration_cast<microseconds>(monitor.sample_cost()).count(), top_sort.c_str());
+      out += line;
+      snprintf(line, sizeof line, "%-24s %-10s %8s %5s %7s %9s %9s %8s\n", "SERVICE", "STATUS", "PID", "PROCS", "CPU%", "RSS", "IO/s", "RESTARTS");
+      out += line;
+      for (auto [name, item] : sorted) {
+        snprintf(line, sizeof line, "%-24s %-10s %8d %5zu %7.1f %9s %9s %8u\n", name->c_str(), item->status.c_str(), (int)item->pid,
+                 item->usage.processes, item->cpu, format_size(rss, sizeof rss, item->usage.rss_bytes), format_size(io, sizeof io, item->io_rate),
+                 item->restarts);
+        out += line;
+      }
+      write_fd(STDOUT_FILENO, out.data(), out.size());
+    };
+    handle_fail([] {
+      connect_nsgod()
+          .then<promise<json>>([] {
+            nsgod().on("started", [](json data) {
+              monitor.started(data["service"]);
+              stale = true;
+            });
+            nsgod().on("stopped", [](json data) { stale = true; });
+            return call_nsgod("status", json::object({}));
+          })
+          .then([](json ret) {
+            monitor.apply_status(ret);
+            // the first sample only sets the baseline for the rates
+            monitor.sample();
+            static int timer = make_timer(duration_cast<nanoseconds>(duration<double>(top_interval)), true);
+            ep->add(EPOLLIN, timer, ep->reg([](epoll_event const &) {
+              uint64_t expirations;
+              if (read(timer, &expirations, sizeof expirations) <= 0) return;
+              refresh();
+              monitor.sample();
+              render();
+            }));
+          })
+          .fail(handle_fail<std::exception_ptr>);
+    });
+    ep->wait();
+  });
+  auto metrics = app.add_subcommand("metrics", "export service and daemon metrics in the prometheus text format");
+  static double metrics_refresh = 5;
+  metrics->add_option("--listen", "metrics-listen"_str, "unix:/path or host:port to serve on")->required();
+  metrics->add_option("--refresh", metrics_refresh, "seconds between refreshes, scrapes in between are served from the cache")
+      ->check(CLI::Range(0.1, 3600.0));
+  metrics->callback([] {
+    static service_monitor monitor;
+    static std::string body;
+    static auto build = [] {
+      static double const hz = sysconf(_SC_CLK_TCK);
+      std::ostringstream out;
+      auto family = [&](char const *name, char const *type, char const *help) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+      };
+      using service = service_monitor::service;
+      auto per_service = [&](char const *name, char const *type, char const *help, auto value) {
+        family(name, type, help);
+        for (auto &[label, item] : monitor.services()) out << name << "{service=\"" << label << "\"} " << value(item) << "\n";
+      };
+      per_service("stone_service_up", "gauge", "1 when the service is running", [](service const &item) { return item.status == "running"; });
+      per_service("stone_service_restarts_total", "counter", "starts of the service seen by this exporter",
+                  [](service const &item) { return item.restarts; });
+      per_service("stone_service_processes", "gauge", "processes in the service tree", [](service const &item) { return item.usage.processes; });
+      per_service("stone_service_cpu_seconds_total", "counter", "cpu time of the processes currently in the service tree",
+                  [](service const &item) { return item.usage.cpu_ticks / hz; });
+      per_service("stone_service_resident_bytes", "gauge", "resident memory of the service tree",
+                  [](service const &item) { return item.usage.rss_bytes; });
+      per_service("stone_service_io_bytes_total", "counter", "bytes read from and written to storage by the service tree",
+                  [](service const &item) { return item.usage.io_bytes; });
+      family("nsgod_rpc_duration_seconds", "histogram", "round trip time of requests to nsgod");
+      for (auto &[method, histogram] : timing().rpc_latency) {
+        auto label = "nsgod_rpc_duration_seconds_bucket{method=\"" + method + "\",le=\"";
+        for (size_t i = 0; i < std::size(histogram.bounds); i++) out << label << histogram.bounds[i] << "\"} " << histogram.buckets[i] << "\n";
+        out << label << "+Inf\"} " << histogram.count << "\n";
+        out << "nsgod_rpc_duration_seconds_sum{method=\"" << method << "\"} " << histogram.sum << "\n";
+        out << "nsgod_rpc_duration_seconds_count{method=\"" << method << "\"} " << histogram.count << "\n";
+      }
+      family("stone_exporter_sample_seconds", "gauge", "time spent sampling /proc on the last refresh");
+      out << "stone_exporter_sample_seconds " << duration<double>(monitor.sample_cost()).count() << "\n";
+      body = out.str();
+    };
+    // scrapes only ever read the cached body, the daemon sees one status call per refresh whatever the scrape rate
+    static auto refresh = [] {
+      call_nsgod("status", json::object({}))
+          .then([](json ret) {
+            monitor.apply_status(ret);
+            monitor.sample();
+            build();
+          })
+          .fail(handle_fail<std::exception_ptr>);
+    };
+    handle_fail([] {
+      static metrics_server server{ ep, listen_address("metrics-listen"_str), body };
+      connect_nsgod()
+          .then([] {
+            nsgod().on("started", [](json data) { monitor.started(data["service"]); });
+            refresh();
+            static int timer = make_timer(duration_cast<nanoseconds>(duration<double>(metrics_refresh)), true);
+            ep->add(EPOLLIN, timer, ep->reg([](epoll_event const &) {
+              uint64_t expirations;
+              if (read(timer, &expirations, sizeof expirations) > 0) refresh();
+            }));
+          })
+          .fail(handle_fail<std::exception_ptr>);
+    });
+    ep->wait();
+  });
+  auto bench = app.add_subcommand("bench", "measure request round trips to nsgod or a service api socket");
+  static std::string bench_method = "ping";
+  static unsigned bench_concurrency = 16;
+  static double bench_duration = 5;
+  bench->add_option("--method", bench_method, "ping and status go to nsgod, execute to the service")
+      ->check(CLI::IsMember(std::vector<std::string>{ "ping", "status", "execute" }));
+  bench->add_option("--service", "bench-service"_str, "service to send execute to")->check(CLI::ExistingDirectory & service_name_validator);
+  bench->add_option("--command", "bench-command"_str, "command line sent by execute")->default_val("/list");
+  bench->add_option("--concurrency", bench_concurrency, "requests kept in flight")->check(CLI::Range(1u, 4096u));
+  bench->add_option("--duration", bench_duration, "seconds to run for")->check(CLI::Range(0.1, 3600.0));
+  bench->add_flag("--stub", "bench-stub"_flag, "run against a local stub server instead of nsgod or a game server");
+  bench->callback([] {
+    static latency_recorder recorder;
+    static steady_clock::time_point began, deadline;
+    static unsigned inflight = 0;
+    static std::unique_ptr<RPC::Client> client;
+    static api::CommandService command;
+    fs::path root = ".stone", api_socket = fs::path("bench-service"_str) / "api.socket";
+    pid_t stub    = 0;
+    handle_fail([&] {
+      if (bench_method == "execute" && "bench-service"_str.empty() && !"bench-stub"_flag) throw std::runtime_error("--service is required for execute");
+      if ("bench-stub"_flag) {
+        char dir[] = "/tmp/stonectl-bench.XXXXXX";
+        if (!mkdtemp(dir)) throw std::runtime_error(std::string("Failed to create stub directory: ") + strerror(errno));
+        root       = dir;
+        api_socket = root / "api.socket";
+        stub       = spawn_stub_server(root);
+        auto limit = steady_clock::now() + 5s;
+        while (!daemon_reachable((root / "nsgod.socket").c_str()) || !daemon_reachable(api_socket.c_str())) {
+          if (steady_clock::now() > limit) throw std::runtime_error("stub server did not come up");
+          std::this_thread::sleep_for(2ms);
+        }
+      } else if (bench_method != "execute" && !daemon_reachable(".stone/nsgod.socket")) {
+        throw std::runtime_error("nsgod is not running");
+      }
+      auto socket = bench_method == "execute" ? api_socket : root / "nsgod.socket";
+      client      = std::make_unique<RPC::Client>(std::make_unique<client_wsio>("ws+unix://" + socket.string(), ep));
+      static void (*issue)() = [] {
+        if (steady_clock::now() >= deadline) {
+          if (inflight == 0) {
+            recorder.report(stdout, steady_clock::now() - began);
+            ep->shutdown();
+          }
+          return;
+        }
+        inflight++;
+        auto sent = steady_clock::now();
+        auto done = [sent] {
+          recorder.record(steady_clock::now() - sent);
+          inflight--;
+          issue();
+        };
+        auto failed = [](std::exception_ptr) {
+          recorder.fail();
+          inflight--;
+          issue();
+        };
+        if (bench_method == "execute")
+          command.execute({ "stonectl", "bench-command"_str }).then([done](std::string) { done(); }).fail(failed);
+        else
+          client->call(bench_method, json::object({})).then([done](json) { done(); }).fail(failed);
+      };
+      // CommandService talks through the api endpoint, the raw client is used for nsgod methods
+      if (bench_method == "execute") api::endpoint() = std::move(client);
+      auto &target = bench_method == "execute" ? api::endpoint() : client;
+      target->start()
+          .then([] {
+            began    = steady_clock::now();
+            deadline = began + duration_cast<steady_clock::duration>(duration<double>(bench_duration));
+            for (unsigned i = 0; i < bench_concurrency; i++) issue();
+          })
+          .fail(handle_fail<std::exception_ptr>);
+      ep->wait();
+    });
+    if (stub) {
+      kill(stub, SIGTERM);
+      waitpid(stub, nullptr, 0);
+      std::error_code ec;
+      fs::remove_all(root, ec);
+    }
+  });
+  auto selftest = app.add_subcommand("selftest", "check parallel range downloads against a local http stub, without the network");
+  selftest->callback([] {
+    struct scenario {
+      char const *name;
+      http_stub_options options;
+      // whether the install must succeed, and what it must print on the way
+      bool installs;
+      char const *expect;
+      // range requests the stub must have answered with 206
+      bool ranged;
+    };
+    static scenario const scenarios[] = {
+      { "ranges honored", { true, true }, true, "", true },
+      { "range ignored (200)", { true, false }, true, "downloading in one stream", false },
+      { "ranges not offered", { false, true }, true, "", false },
+    };
+    bool passed = true;
+    handle_fail([&] {
+      char dir[] = "/tmp/stonectl-selftest.XXXXXX";
+      if (!mkdtemp(dir)) throw std::runtime_error(std::string("Failed to create selftest directory: ") + strerror(errno));
+      fs::path root = dir;
+      guard cleanup{ [&] {
+        std::error_code ec;
+        fs::remove_all(root, ec);
+      } };
+      // big enough for four 4 MiB segments, served as the nsgod component so no archive has to be built
+      fs::create_directories(root / "www");
+      std::vector<char> payload(24 << 20);
+      std::mt19937_64 random{ 42 };
+      for (size_t i = 0; i < payload.size(); i += 8) *(uint64_t *)&payload[i] = random();
+      std::ofstream{ root / "www" / "nsgod", std::ios::binary }.write(payload.data(), payload.size());
+      sha256 hasher;
+      hasher.update(payload.data(), payload.size());
+      auto digest = hasher.hex();
+
+      for (auto &item : scenarios) {
+        auto work = root / std::to_string(&item - scenarios);
+        auto log  = work / "requests.log";
+        fs::create_directories(work / ".stone");
+        int listener = listen_address("127.0.0.1:0");
+        sockaddr_in addr{};
+        socklen_t len = sizeof addr;
+        getsockname(listener, (sockaddr *)&addr, &len);
+        auto mirror = "http://127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+        pid_t stub  = spawn_http_stub(root / "www", listener, item.options, log);
+        close(listener);
+
+        int out[2];
+        if (pipe2(out, O_CLOEXEC) != 0) throw std::runtime_error(std::string("Failed to create pipe: ") + strerror(errno));
+        auto began = steady_clock::now();
+        pid_t child = fork();
+        if (child == 0) {
+          dup2(out[1], STDOUT_FILENO);
+          dup2(out[1], STDERR_FILENO);
+          if (chdir(work.c_str()) != 0) _exit(127);
+          auto pin = "nsgod=" + digest;
+          execl("/proc/self/exe", "stonectl", "install", "nsgod", "--mirror", mirror.c_str(), "--sha256", pin.c_str(), "--no-cache", "--segments", "4",
+                nullptr);
+          _exit(127);
+        }
+        close(out[1]);
+        std::string output;
+        char buf[4096];
+        ssize_t got;
+        while ((got = read(out[0], buf, sizeof buf)) > 0 || (got < 0 && errno == EINTR))
+          if (got > 0) output.append(buf, got);
+        close(out[0]);
+        waitpid(child, nullptr, 0);
+        auto elapsed = duration_cast<milliseconds>(steady_clock::now() - began).count();
+        kill(stub, SIGTERM);
+        waitpid(stub, nullptr, 0);
+
+        std::ifstream installed{ work / ".stone" / "nsgod", std::ios::binary };
+        std::string content{ std::istreambuf_iterator<char>{ installed }, {} };
+        bool complete = content.size() == payload.size() && memcmp(content.data(), payload.data(), payload.size()) == 0;
+        std::ifstream requests{ log };
+        size_t partial = 0;
+        for (std::string line; std::getline(requests, line);)
+          if (line.find(" 206 ") != std::string::npos) partial++;
+        std::string problem;
+        if (complete != item.installs)
+          problem = item.installs ? "nsgod was not installed intact" : "nsgod was installed from a bad response";
+        else if (*item.expect && output.find(item.expect) == std::string::npos)
+          problem = std::string("expected \"") + item.expect + "\" in the output";
+        else if (item.ranged != (partial > 1))
+          problem = item.ranged ? "the body was not fetched in ranges" : "ranges were fetched when they should not be";
+        if (problem.empty()) {
+          std::cout << item.name << ": ok (" << partial << " range(s), " << elapsed << "ms)" << std::endl;
+        } else {
+          passed = false;
+          std::cout << item.name << ": FAILED, " << problem << std::endl << output << std::endl;
+        }
+      }
+    });
+    if (!passed) exit(EXIT_FAILURE);
+  });
   auto dump = app.add_subcommand("dump", "dump service stack");
-  dump->add_option("service", "dump-service"_str, "target service to dump")->required()->check(CLI::ExistingDirectory & service_name_validator);
+  dump->add_option("service", "dump-service"_vstr, "target service(s) to dump")->check(CLI::ExistingDirectory & service_name_validator)->expected(-1);
+  dump->add_flag("--all", "dump-all"_flag, "dump every running service");
+  dump->add_option("--output,-o", "dump-output"_str, "directory receiving one <service>.txt per dump (default: stdout for a single service)");
+  static unsigned dump_idle = 300, dump_timeout = 10;
+  dump->add_option("--idle", dump_idle, "milliseconds without output after which a dump is complete");
+  dump->add_option("--timeout", dump_timeout, "seconds to wait for a service to start dumping");
   dump->callback([] {
+    struct capture {
+      int fd = -1;
+      size_t bytes = 0;
+      steady_clock::time_point last;
+    };
+    // one lookup per output event, the daemon sends them for every service it manages
+    static std::unordered_map<std::string, capture> pending;
+    static std::vector<std::string> written, missing;
+    static steady_clock::time_point sent;
+    static auto finish = [](std::string const &service, capture &item) {
+      if (item.fd > STDOUT_FILENO) close(item.fd);
+      (item.bytes ? written : missing).push_back(service);
+    };
+    static auto report = [] {
+      auto elapsed = duration_cast<milliseconds>(steady_clock::now() - sent).count();
+      if (!"dump-output"_str.empty()) std::cerr << written.size() << " dump(s) written to " << "dump-output"_str << " in " << elapsed << "ms" << std::endl;
+      if (!missing.empty()) {
+        std::sort(missing.begin(), missing.end());
+        std::cerr << "no dump from:";
+        for (auto &service : missing) std::cerr << " " << service;
+        std::cerr << std::endl;
+      }
+      ep->shutdown();
+      if (!missing.empty()) exit(EXIT_FAILURE);
+    };
     handle_fail([] {
-      nsgod()
-          .start()
-          .then<promise<void>>([] {
+      if ("dump-service"_vstr.empty() && !"dump-all"_flag) throw std::runtime_error("service or --all is required");
+      if ("dump-output"_str.empty() && ("dump-all"_flag || "dump-service"_vstr.size() > 1)) "dump-output"_str = "dumps";
+      connect_nsgod()
+          .then<promise<json>>([] { return call_nsgod("status", json::object({})); })
+          .then<promise<void>>([](json status) {
+            std::vector<std::string> targets;
+            auto add = [&](std::string const &service) {
+              if (!status.contains(service)) throw std::runtime_error("unknown service: " + service);
+              if (status[service]["status"] != "running") throw std::runtime_error(service + " is not running");
+              if (pending.count(service)) return;
+              auto &item = pending[service];
+              if ("dump-output"_str.empty()) {
+                item.fd = STDOUT_FILENO;
+              } else {
+                fs::create_directories("dump-output"_str);
+                auto file = fs::path("dump-output"_str) / (service + ".txt");
+                item.fd   = ::open(file.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+                if (item.fd < 0) throw std::runtime_error("Failed to create " + file.string() + ": " + strerror(errno));
+              }
+              targets.push_back(service);
+            };
+            if ("dump-all"_flag) {
+              for (auto [k, v] : status.items())
+                if (v["status"] == "running") add(k);
+            } else {
+              for (auto &service : "dump-service"_vstr) add(service);
+            }
+            if (targets.empty()) throw std::runtime_error("no running service to dump");
             nsgod().on("output", [](json data) {
-              if (data["service"] == "dump-service"_str) { std::cout << data["data"].get<std::string>() << std::flush; }
+              auto it = pending.find(data["service"].get_ref<std::string const &>());
+              if (it == pending.end()) return;
+              auto &text = data["data"].get_ref<std::string const &>();
+              write_fd(it->second.fd, text.data(), text.size());
+              it->second.bytes += text.size();
+              it->second.last = steady_clock::now();
+            });
+            sent = steady_clock::now();
+            return promise<void>::map_all(targets, [](std::string const &input) -> promise<void> {
+              return call_nsgod("kill", json::object({
+                                            { "service", input },
+                                            { "signal", SIGUSR1 },
+                                            { "restart", 0 },
+                                        }))
+                  .then<void>([](json ret) {});
             });
-            return nsgod()
-                .call("kill", json::object({
-                                  { "service", "dump-service"_str },
-                                  { "signal", SIGUSR1 },
-                                  { "restart", 0 },
-                              }))
-                .then<void>([](json ret) {});
+          })
+          .then([] {
+            // there is no end marker in the output, a dump is complete once its service has been quiet for --idle
+            static int timer = make_timer(50ms, true);
+            ep->add(EPOLLIN, timer, ep->reg([](epoll_event const &) {
+              uint64_t expirations;
+              if (read(timer, &expirations, sizeof expirations) <= 0) return;
+              auto now = steady_clock::now();
+              for (auto it = pending.begin(); it != pending.end();) {
+                auto &item = it->second;
+                if (item.bytes ? now - item.last >= milliseconds(dump_idle) : now - sent >= seconds(dump_timeout)) {
+                  finish(it->first, item);
+                  it = pending.erase(it);
+                } else {
+                  ++it;
+                }
+              }
+              if (pending.empty()) report();
+            }));
           })
           .fail(handle_fail<std::exception_ptr>);
     });
@@ -240,39 +1061,84 @@ int main(int argc, char **argv) {
   stop->add_flag("--restart,!--no-restart", "stop-restart"_flag, "restart service after killed");
   stop->add_flag("--force", "stop-force"_flag, "force stop service(SIGKILL)");
   stop->add_flag("--wait", "stop-wait"_flag, "wait for stopped");
+  static unsigned stop_timeout = 0, stop_kill_timeout = 5;
+  stop->add_option("--timeout", stop_timeout, "seconds to wait before escalating to SIGKILL, implies --wait");
+  stop->add_option("--kill-timeout", stop_kill_timeout, "seconds to wait after SIGKILL (--force or escalation) before giving up on a service");
   stop->callback([] {
-    handle_fail([] {
-      nsgod()
-          .start()
-          .then<promise<void>>([] {
-            return promise<void>::map_all(std::vector<std::string>{ "stop-service"_vstr }, [](std::string const &input) -> promise<void> {
-              return nsgod().call("status", json::object({ { "service", input } })).then<void>([](json ret) {});
-            });
-          })
-          .then<promise<void>>([] {
-            return promise<void>::map_all(std::vector<std::string>{ "stop-service"_vstr }, [](std::string const &input) -> promise<void> {
-              if ("stop-wait"_flag)
-                nsgod().on("stopped", [](json data) {
-                  static size_t killed = 0;
-                  if (std::find("stop-service"_vstr.begin(), "stop-service"_vstr.end(), data["service"]) != "stop-service"_vstr.end()) {
-                    killed++;
-                    std::cout << data["service"].get<std::string>() << " stopped" << std::endl;
-                  }
-                  if (killed == "stop-service"_vstr.size()) ep->shutdown();
-                });
-              return nsgod()
-                  .call("kill", json::object({
-                                    { "service", input },
-                                    { "signal", SIGTERM },
+    // one subscription and a hash set, so every stopped event costs the same however many services are stopped
+    static std::unordered_set<std::string> pending;
+    static std::vector<std::string> stopped, escalated;
+    static int signal = "stop-force"_flag ? SIGKILL : SIGTERM;
+    static bool wait  = "stop-wait"_flag || stop_timeout;
+    static auto send_signal = [](std::string const &service, int signal) {
+      return call_nsgod("kill", json::object({
+                                    { "service", service },
+                                    { "signal", signal },
                                     { "restart", "stop-restart"_flag ? 1 : -1 },
-                                }))
-                  .then<void>([](json ret) {});
+                                }));
+    };
+    static auto report = [] {
+      // stopped events may drain the set before the last kill reply arrives
+      static bool reported = false;
+      if (std::exchange(reported, true)) return;
+      std::cout << stopped.size() << " stopped";
+      if (!escalated.empty()) {
+        std::cout << ", " << escalated.size() << " escalated to SIGKILL:";
+        for (auto &service : escalated) std::cout << " " << service;
+      }
+      if (!pending.empty()) {
+        std::cout << ", " << pending.size() << " stuck:";
+        for (auto &service : pending) std::cout << " " << service;
+      }
+      std::cout << std::endl;
+      ep->shutdown();
+      if (!pending.empty()) exit(EXIT_FAILURE);
+    };
+    handle_fail([] {
+      connect_nsgod()
+          .then<promise<json>>([] { return call_nsgod("status", json::object({})); })
+          .then<promise<void>>([](json status) {
+            std::vector<std::string> targets;
+            for (auto &service : "stop-service"_vstr) {
+              if (!status.contains(service)) throw std::runtime_error("unknown service: " + service);
+              // a service that is not running would never report stopped
+              if (status[service]["status"] != "running") {
+                std::cout << service << " is not running" << std::endl;
+                continue;
+              }
+              if (pending.insert(service).second) targets.push_back(service);
+            }
+            if (wait)
+              nsgod().on("stopped", [](json data) {
+                if (!pending.erase(data["service"].get<std::string>())) return;
+                stopped.push_back(data["service"].get<std::string>());
+                std::cout << stopped.back() << " stopped" << std::endl;
+                if (pending.empty()) report();
+              });
+            return promise<void>::map_all(targets, [](std::string const &input) -> promise<void> {
+              return send_signal(input, signal).then<void>([](json ret) {});
             });
           })
           .then([] {
-            std::cout << "sent SIGTERM signal to "
-                      << "stop-service"_vstr.size() << " service(s)" << std::endl;
-            if (!"stop-wait"_flag) ep->shutdown();
+            std::cout << "sent " << (signal == SIGKILL ? "SIGKILL" : "SIGTERM") << " signal to " << pending.size() + stopped.size() << " service(s)"
+                      << std::endl;
+            if (!wait) return ep->shutdown();
+            if (pending.empty()) return report();
+            // once SIGKILL is out only the kill timeout is left, whatever is still pending then is stuck
+            static auto arm_deadline = [] {
+              static int deadline = make_timer(seconds(stop_kill_timeout));
+              ep->add(EPOLLIN, deadline, ep->reg([](epoll_event const &) { report(); }));
+            };
+            if (signal == SIGKILL) return arm_deadline();
+            if (!stop_timeout) return;
+            static int timer = make_timer(seconds(stop_timeout));
+            ep->add(EPOLLIN, timer, ep->reg([](epoll_event const &) {
+              ep->del(timer);
+              escalated.assign(pending.begin(), pending.end());
+              std::sort(escalated.begin(), escalated.end());
+              for (auto &service : escalated) send_signal(service, SIGKILL).fail(handle_fail<std::exception_ptr>);
+              arm_deadline();
+            }));
           })
           .fail(handle_fail<std::exception_ptr>);
     });
@@ -281,9 +1147,8 @@ int main(int argc, char **argv) {
   auto ping = app.add_subcommand("ping-daemon", "ping daemon");
   ping->callback([] {
     handle_fail([] {
-      nsgod()
-          .start()
-          .then<promise<json>>([] { return nsgod().call("ping", json::object({})); })
+      connect_nsgod()
+          .then<promise<json>>([] { return call_nsgod("ping", json::object({})); })
           .then([](auto) {
             std::cout << "daemon is running" << std::endl;
             ep->shutdown();
@@ -295,9 +1160,8 @@ int main(int argc, char **argv) {
   auto kill = app.add_subcommand("kill-daemon", "stop all services and kill the daemon");
   kill->callback([] {
     handle_fail([] {
-      nsgod()
-          .start()
-          .then<promise<json>>([] { return nsgod().call("shutdown", json::object({})); })
+      connect_nsgod()
+          .then<promise<json>>([] { return call_nsgod("shutdown", json::object({})); })
           .then([](auto) {
             std::cout << "daemon is shutdown" << std::endl;
             ep->shutdown();
@@ -306,38 +1170,439 @@ int main(int argc, char **argv) {
     });
     ep->wait();
   });
-  auto attach = app.add_subcommand("attach", "attach to service's command interface");
-  attach->add_option("service", "attach-service"_str, "target service name")->required()->check(CLI::ExistingDirectory & service_name_validator);
+  auto exec = app.add_subcommand("exec", "run commands on a service, pipelined");
+  exec->add_option("service", "exec-service"_str, "target service name")->required()->check(CLI::ExistingDirectory & service_name_validator);
+  exec->add_option("commands", "exec-commands"_vstr, "commands to run, read from --file when none are given");
+  exec->add_option("-f,--file", "exec-file"_str, "file with one command per line, - for stdin")->default_val("-");
+  exec->add_option("--as", "exec-executor"_str, "executor name")->default_val("stonectl");
+  static unsigned exec_window = 64;
+  exec->add_option("--window", exec_window, "commands in flight at once")->check(CLI::Range(1u, 65536u));
+  exec->add_flag("--json", "exec-json"_flag, "print one json object per command with its output and latency");
+  exec->callback([] {
+    struct result {
+      bool done = false, failed = false;
+      std::string output;
+      steady_clock::duration elapsed;
+    };
+    static std::vector<std::string> lines;
+    static std::vector<result> results;
+    static size_t sent = 0, printed = 0;
+    static latency_recorder recorder;
+    static steady_clock::time_point began;
+    static std::string buffer;
+    static api::CommandService command;
+    handle_fail([] {
+      lines = "exec-commands"_vstr;
+      if (lines.empty()) {
+        std::ifstream file;
+        if ("exec-file"_str != "-") {
+          file.open("exec-file"_str);
+          if (!file) throw std::runtime_error("Failed to open " + "exec-file"_str);
+        }
+        std::istream &in = "exec-file"_str == "-" ? std::cin : file;
+        for (std::string line; std::getline(in, line);)
+          if (!line.empty()) lines.push_back(std::move(line));
+      }
+      results.resize(lines.size());
+      api::endpoint() = std::make_unique<RPC::Client>(std::make_unique<client_wsio>("ws+unix://" + "exec-service"_str + "/api.socket", ep));
+      // results are printed in input order as soon as every earlier command has answered
+      static auto drain = [] {
+        for (; printed < results.size() && results[printed].done; printed++) {
+          auto &item = results[printed];
+          if ("exec-json"_flag) {
+            json line = { { "index", printed },
+                          { "command", lines[printed] },
+                          { item.failed ? "error" : "output", item.output },
+                          { "ms", duration<double, std::milli>(item.elapsed).count() } };
+            buffer += line.dump() + "\n";
+          } else {
+            buffer += item.failed ? "error: " + item.output : item.output;
+            if (!item.output.empty() && item.output.back() != '\n') buffer += '\n';
+          }
+          std::string().swap(item.output);
+        }
+        if (buffer.size() >= 64 * 1024 || printed == results.size()) {
+          write_fd(STDOUT_FILENO, buffer.data(), buffer.size());
+          buffer.clear();
+        }
+        if (printed == results.size()) {
+          recorder.report(stderr, steady_clock::now() - began);
+          ep->shutdown();
+        }
+      };
+      static void (*issue)() = [] {
+        if (sent == lines.size()) return;
+        auto index = sent++;
+        auto start = steady_clock::now();
+        auto finish = [index, start](bool failed, std::string output) {
+          auto &item   = results[index];
+          item.done    = true;
+          item.failed  = failed;
+          item.output  = std::move(output);
+          item.elapsed = steady_clock::now() - start;
+          if (failed)
+            recorder.fail();
+          else
+            recorder.record(item.elapsed);
+          issue();
+          drain();
+        };
+        command.execute({ "exec-executor"_str, lines[index] })
+            .then([finish](std::string output) { finish(false, std::move(output)); })
+            .fail([finish](std::exception_ptr e) {
+              try {
+                if (e) std::rethrow_exception(e);
+                finish(true, "unknown error");
+              } catch (std::exception &ex) { finish(true, ex.what()); } catch (...) {
+                finish(true, "unknown error");
+              }
+            });
+      };
+      api::endpoint()
+          ->start()
+          .then([] {
+            began = steady_clock::now();
+            if (lines.empty()) return drain();
+            for (unsigned i = 0; i < exec_window; i++) issue();
+          })
+          .fail(handle_fail<std::exception_ptr>);
+      ep->wait();
+    });
+  });
+  auto backup = app.add_subcommand("backup", "back up a service's worlds, holding saves only while changed files are copied");
+  backup->add_option("service", "backup-service"_str, "target service name")->required()->check(CLI::ExistingDirectory & service_name_validator);
+  backup->add_option("--worlds", "backup-worlds"_str, "worlds directory inside the service")->default_val("worlds");
+  backup->add_option("--store", "backup-store"_str, "backup store directory (default: .stone/backups/<service>)");
+  backup->add_option("--as", "backup-executor"_str, "executor name")->default_val("stonectl");
+  static unsigned backup_jobs = 0, backup_hold_timeout = 60;
+  backup->add_option("--jobs", backup_jobs, "compression threads (default: one per core)");
+  backup->add_option("--hold-timeout", backup_hold_timeout, "seconds to wait for the held save to become ready");
+  backup->callback([] {
+    static api::CommandService command;
+    static std::unique_ptr<backup_store> store;
+    static backup_store::stats info;
+    static steady_clock::time_point held;
+    static steady_clock::duration paused;
+    static auto run = [](std::string const &line) { return command.execute({ "backup-executor"_str, line }); };
+    static auto finish = [] {
+      auto began = steady_clock::now();
+      store->ingest(backup_jobs ? backup_jobs : std::thread::hardware_concurrency(), info);
+      auto manifest = store->commit();
+      std::cout << "saves held for " << duration_cast<milliseconds>(paused).count() << "ms: " << info.files << " file(s), " << info.linked
+                << " unchanged, " << info.cloned << " copied" << std::endl;
+      std::cout << info.changed << " changed file(s), " << info.bytes_read << " bytes chunked, " << info.new_chunks << " new chunk(s), "
+                << info.bytes_written << " bytes written in " << duration_cast<milliseconds>(steady_clock::now() - began).count() << "ms" << std::endl;
+      std::cout << "manifest: " << manifest.string() << std::endl;
+      ep->shutdown();
+    };
+    // the snapshot is taken between hold and resume, a failure still resumes saving before it is reported
+    static auto take = [](std::vector<std::pair<std::string, uint64_t>> files) {
+      std::exception_ptr error;
+      try {
+        store->snapshot(fs::path("backup-service"_str) / "backup-worlds"_str, files, info);
+      } catch (...) { error = std::current_exception(); }
+      run("save resume")
+          .then([error](std::string) {
+            paused = steady_clock::now() - held;
+            if (error) std::rethrow_exception(error);
+            handle_fail(finish);
+          })
+          .fail(handle_fail<std::exception_ptr>);
+    };
+    static void (*query)() = [] {
+      run("save query")
+          .then([](std::string output) {
+            auto files = parse_save_query(output);
+            if (!files.empty()) return take(std::move(files));
+            if (steady_clock::now() - held > seconds(backup_hold_timeout)) {
+              run("save resume").then([](std::string) { handle_fail([] { throw std::runtime_error("Timed out waiting for the save to be ready"); }); });
+              return;
+            }
+            static int timer = [] {
+              int fd = make_timer(0ns);
+              ep->add(EPOLLIN, fd, ep->reg([fd](epoll_event const &) {
+                uint64_t expirations;
+                if (read(fd, &expirations, sizeof expirations) > 0) query();
+              }));
+              return fd;
+            }();
+            arm_timer(timer, 100ms);
+          })
+          .fail(handle_fail<std::exception_ptr>);
+    };
+    handle_fail([] {
+      if ("backup-store"_str.empty()) "backup-store"_str = (fs::path(".stone/backups") / "backup-service"_str).string();
+      store           = std::make_unique<backup_store>("backup-store"_str);
+      api::endpoint() = std::make_unique<RPC::Client>(std::make_unique<client_wsio>("ws+unix://" + "backup-service"_str + "/api.socket", ep));
+      api::endpoint()
+          ->start()
+          .then<promise<std::string>>([] {
+            held = steady_clock::now();
+            return run("save hold");
+          })
+          .then([](std::string) { query(); })
+          .fail(handle_fail<std::exception_ptr>);
+      ep->wait();
+    });
+  });
+  static auto log_filter_options = [](CLI::App *sub) {
+    sub->add_option("--level", "log-level"_str, "lowest level shown: T, D, I, W or E")->check(CLI::Validator(
+        [](std::string &input) -> std::string {
+          try {
+            parse_log_level(input);
+            return {};
+          } catch (std::exception &ex) { return ex.what(); }
+        },
+        "LEVEL", "log level"));
+    sub->add_option("--tag", log_settings().tags, "only show entries whose tag matches one of the globs");
+  };
+  auto logs = app.add_subcommand("logs", "print a service's log, or follow its log entries");
+  logs->add_option("service", "logs-service"_str, "target service name")->required()->check(CLI::ExistingDirectory & service_name_validator);
+  logs->add_flag("--follow,-f", "logs-follow"_flag, "stream log entries from the running service");
+  log_filter_options(logs);
+  logs->add_option("--since", "logs-since"_str, "first time to show: a date and time, epoch seconds, or an age like 30m or 2d");
+  logs->add_option("--until", "logs-until"_str, "last time to show, same forms as --since");
+  logs->add_option("--grep", "logs-grep"_str, "only show lines matching the extended regular expression");
+  logs->add_flag("--rotate", "logs-rotate"_flag,
+                 "move stone.log into a compressed, indexed segment when it is due; start does this before each launch, services that stay up "
+                 "for long need it from cron");
+  static std::string rotate_size = "64M", rotate_age = "1d";
+  static size_t rotate_keep = rotation_settings().keep;
+  logs->add_option("--max-size", rotate_size, "rotate once stone.log is larger than this, K, M and G suffixes allowed (default: 64M)");
+  logs->add_option("--max-age", rotate_age, "rotate once the live log is older than this, like 12h or 7d (default: 1d)");
+  logs->add_option("--keep", rotate_keep, "compressed segments to keep (default: 90)");
+  logs->callback([] {
+    if ("logs-rotate"_flag) {
+      handle_fail([] {
+        char *suffix;
+        uint64_t size = strtoull(rotate_size.c_str(), &suffix, 10);
+        switch (toupper(*suffix)) {
+        case 'G': size <<= 10; [[fallthrough]];
+        case 'M': size <<= 10; [[fallthrough]];
+        case 'K': size <<= 10; [[fallthrough]];
+        case '\0': break;
+        default: throw std::runtime_error("Invalid size: " + rotate_size);
+        }
+        auto age = parse_age_arg(rotate_age);
+        if (age < 0) throw std::runtime_error("Invalid age: " + rotate_age);
+        log_store store{ "logs-service"_str };
+        std::cout << (store.rotate(size, seconds(age), rotate_keep) ? "rotated" : "not due") << std::endl;
+      });
+      return;
+    }
+    if (!"logs-follow"_flag) {
+      handle_fail([] {
+        regex_t grep;
+        bool has_grep = !"logs-grep"_str.empty();
+        if (has_grep && regcomp(&grep, "logs-grep"_str.c_str(), REG_EXTENDED | REG_NOSUB) != 0) throw std::runtime_error("Invalid pattern: " + "logs-grep"_str);
+        guard grep_guard{ [&] {
+          if (has_grep) regfree(&grep);
+        } };
+        time_t since = "logs-since"_str.empty() ? 0 : parse_time_arg("logs-since"_str);
+        time_t until = "logs-until"_str.empty() ? 0 : parse_time_arg("logs-until"_str);
+        std::string buffer;
+        buffer.reserve(512 * 1024);
+        log_store{ "logs-service"_str }.query(since, until, has_grep ? &grep : nullptr, [&](char const *line, size_t size) {
+          buffer.append(line, size);
+          if (buffer.size() < 256 * 1024) return;
+          write_fd(STDOUT_FILENO, buffer.data(), buffer.size());
+          buffer.clear();
+        });
+        write_fd(STDOUT_FILENO, buffer.data(), buffer.size());
+      });
+      return;
+    }
+    handle_fail([] {
+      using namespace api;
+      if (!"log-level"_str.empty()) log_settings().min_level = parse_log_level("log-level"_str);
+      endpoint() = std::make_unique<RPC::Client>(std::make_unique<client_wsio>("ws+unix://" + "logs-service"_str + "/api.socket", ep));
+      static CoreService core;
+      // entries are batched into large writes, flushed when the buffer fills or after a short delay
+      static std::string buffer;
+      static bool color       = isatty(STDOUT_FILENO);
+      static int flush_timer  = make_timer(0ns);
+      static bool armed       = false;
+      constexpr size_t high_water = 256 * 1024;
+      static auto flush = [] {
+        armed = false;
+        write_fd(STDOUT_FILENO, buffer.data(), buffer.size());
+        buffer.clear();
+      };
+      buffer.reserve(high_water * 2);
+      ep->add(EPOLLIN, flush_timer, ep->reg([](epoll_event const &) {
+        uint64_t expirations;
+        if (read(flush_timer, &expirations, sizeof expirations) > 0) flush();
+      }));
+      endpoint()
+          ->start()
+          .then([] {
+            core.log >> [](LogEntry const &entry) {
+              if (!log_settings().accepts(entry.level, entry.tag)) return;
+              auto level = print_level(entry.level);
+              if (color)
+                buffer.append(level);
+              else
+                buffer += level.back();
+              buffer.append(" [").append(entry.tag).append("] ").append(entry.content).append(color ? "\033[0m\n" : "\n");
+              if (buffer.size() >= high_water) return flush();
+              if (!std::exchange(armed, true)) arm_timer(flush_timer, 100ms);
+            };
+          })
+          .fail(handle_fail<std::exception_ptr>);
+      ep->wait();
+    });
+  });
+  auto attach = app.add_subcommand("attach", "attach to the command interface of one or more services");
+  attach->add_option("service", "attach-service"_vstr, "target service name(s)")
+      ->required()
+      ->expected(-1)
+      ->check(CLI::ExistingDirectory & service_name_validator);
   attach->add_option("--as", "attach-executor"_str, "executor name")->default_val("stonectl");
+  attach->add_option("--target", "attach-target"_str, "service commands and chat go to at first, * sends to all (default: the first service)");
+  static unsigned attach_fps = 30, attach_frame_lines = 1000;
+  attach->add_option("--fps", attach_fps, "maximum terminal updates per second")->check(CLI::Range(1u, 240u));
+  attach->add_option("--frame-lines", attach_frame_lines, "log lines shown per update, the rest are dropped and counted")->check(CLI::Range(1u, 100000u));
+  log_filter_options(attach);
   attach->callback([] {
     handle_fail([] {
       using namespace api;
+      if (!"log-level"_str.empty()) log_settings().min_level = parse_log_level("log-level"_str);
 
-      static auto prompt = "attach-service"_str + "> ";
+      // One client per service, all driven by ep. The stone-api services call through the single api::endpoint(),
+      // so every subscription and request swaps the client of its service in for the duration of the call.
+      struct attached {
+        std::string name;
+        std::unique_ptr<RPC::Client> client;
+        bool connected = false;
+      };
+      static std::vector<attached> services;
+      for (auto &name : "attach-service"_vstr)
+        if (std::none_of(services.begin(), services.end(), [&](auto &item) { return item.name == name; }))
+          services.push_back({ name, std::make_unique<RPC::Client>(std::make_unique<client_wsio>("ws+unix://" + name + "/api.socket", ep)) });
+      static auto through = [](attached &item, auto &&call) {
+        std::swap(endpoint(), item.client);
+        guard restore{ [&] { std::swap(endpoint(), item.client); } };
+        return call();
+      };
+      // a single service keeps the plain output, several are told apart by a name column
+      static bool tagged  = services.size() > 1;
+      static size_t width = 0;
+      for (auto &item : services) width = std::max(width, item.name.size());
+      static auto label = [](attached const &item) { return "\033[1m" + item.name + std::string(width - item.name.size(), ' ') + "\033[0m "; };
 
-      endpoint() = std::make_unique<RPC::Client>(std::make_unique<client_wsio>("ws+unix://" + "attach-service"_str + "/api.socket", ep));
+      // index into services, npos sends to every one of them
+      static size_t target = 0;
+      if ("attach-target"_str == "*")
+        target = std::string::npos;
+      else if (!"attach-target"_str.empty()) {
+        auto it = std::find_if(services.begin(), services.end(), [](auto &item) { return item.name == "attach-target"_str; });
+        if (it == services.end()) throw std::runtime_error("--target " + "attach-target"_str + " is not one of the attached services");
+        target = it - services.begin();
+      }
+      static std::string prompt;
+      static auto update_prompt = [] { prompt = (target == std::string::npos ? "*" : services[target].name) + "> "; };
+      update_prompt();
       static CoreService core;
       static CommandService command;
       static ChatService chat;
 
-      constexpr auto wrapped_output = +[](std::string const &data) {
+      // Output is collected into one buffer and written at most attach_fps times a second with a single prompt
+      // redraw, so a log flood costs one terminal update per frame instead of two redraws per line
+      static std::string frame;
+      static size_t frame_logs = 0, dropped = 0;
+      static int frame_timer   = make_timer(0ns);
+      static bool armed        = false;
+      static auto flush = [] {
+        armed = false;
+        // a terminal that cannot take more output keeps the frame, the loop never blocks on it
+        pollfd pfd{ STDOUT_FILENO, POLLOUT, 0 };
+        if (poll(&pfd, 1, 0) != 1) {
+          armed = true;
+          arm_timer(frame_timer, nanoseconds(1s) / attach_fps);
+          return;
+        }
+        if (dropped) {
+          frame += "\033[90m-- " + std::to_string(dropped) + " log line(s) dropped, the terminal could not keep up --\033[0m\n";
+          dropped = 0;
+        }
+        // clear the prompt line, readline puts it back below the output
+        write_fd(STDOUT_FILENO, "\r\033[K", 4);
+        write_fd(STDOUT_FILENO, frame.data(), frame.size());
+        frame.clear();
+        frame_logs = 0;
+        rl_forced_update_display();
+      };
+      static auto schedule = [] {
+        if (std::exchange(armed, true)) return;
+        arm_timer(frame_timer, nanoseconds(1s) / attach_fps);
+      };
+      static auto wrapped_output = [](attached const &item, std::string const &data) {
         if (data.length() == 0) return;
+        if (tagged) {
+          // every line of a multi-line reply carries the name
+          std::istringstream lines{ data };
+          for (std::string line; std::getline(lines, line);) frame.append(label(item)).append(line).append("\n");
+        } else
+          frame += data;
+        schedule();
+      };
+      ep->add(EPOLLIN, frame_timer, ep->reg([](epoll_event const &) {
+        uint64_t expirations;
+        if (read(frame_timer, &expirations, sizeof expirations) > 0) flush();
+      }));
 
-        char *saved_line;
-        int saved_point;
-        saved_point = rl_point;
-        saved_line  = strndup(rl_line_buffer, rl_end);
-        guard free_line{ [&] { free(saved_line); } };
-        rl_set_prompt("");
-        rl_forced_update_display();
-        std::cout << data;
-        rl_set_prompt(prompt.c_str());
-        rl_insert_text(saved_line);
-        rl_point = saved_point;
-        rl_forced_update_display();
+      // "/command" and chat go to the target; "@name" switches it ("@*" to all), "@name text" sends once elsewhere
+      static auto submit = [](std::string line) {
+        std::vector<attached *> to;
+        if (line[0] == '@') {
+          auto space = line.find(' ');
+          auto name  = line.substr(1, space == std::string::npos ? std::string::npos : space - 1);
+          auto it    = std::find_if(services.begin(), services.end(), [&](auto &item) { return item.name == name; });
+          if (name != "*" && it == services.end()) return wrapped_output(services[0], "\033[31mNo attached service named " + name + "\033[0m\n");
+          if (space == std::string::npos) {
+            target = name == "*" ? std::string::npos : it - services.begin();
+            update_prompt();
+            rl_set_prompt(prompt.c_str());
+            return;
+          }
+          line = line.substr(space + 1);
+          if (name == "*")
+            for (auto &item : services) to.push_back(&item);
+          else
+            to.push_back(&*it);
+        } else if (target == std::string::npos)
+          for (auto &item : services) to.push_back(&item);
+        else
+          to.push_back(&services[target]);
+        for (auto item : to) {
+          if (!item->connected) {
+            wrapped_output(*item, "\033[31mnot connected\033[0m\n");
+            continue;
+          }
+          if (line[0] != '/') {
+            through(*item, [&] { chat.send({ "attach-executor"_str, line }); });
+            continue;
+          }
+          // a failing service reports in its own line instead of ending the session for all of them
+          through(*item, [&] { return command.execute({ "attach-executor"_str, line }); })
+              .then([item](std::string output) { wrapped_output(*item, output); })
+              .fail([item](std::exception_ptr e) {
+                try {
+                  if (e) std::rethrow_exception(e);
+                } catch (std::exception &ex) {
+                  wrapped_output(*item, std::string("\033[31m") + ex.what() + "\033[0m\n");
+                }
+              });
+        }
       };
 
-      endpoint()->start().then([&] {
+      static size_t settled = 0;
+      static auto ready = [] {
+        if (++settled < services.size()) return;
+        if (std::none_of(services.begin(), services.end(), [](auto &item) { return item.connected; })) {
+          std::cerr << "No service could be attached" << std::endl;
+          exit(EXIT_FAILURE);
+        }
         struct termios term;
         tcgetattr(STDIN_FILENO, &term);
         term.c_lflag &= ~ICANON;
@@ -350,18 +1615,9 @@ int main(int argc, char **argv) {
             return;
           }
           guard line_guard{ [&] { free(line); } };
-          if (line[0] == '/')
-            command.execute({ "attach-executor"_str, line }).then(wrapped_output).fail(handle_fail<std::exception_ptr>);
-          else
-            chat.send({ "attach-executor"_str, line });
+          if (line[0]) submit(line);
         });
 
-        core.log >> [](LogEntry const &entry) {
-          std::stringstream ss;
-          ss << print_level(entry.level) << " [" << entry.tag << "] " << entry.content << "\033[0m\n";
-          wrapped_output(ss.str());
-        };
-
         ep->add(EPOLLIN, STDIN_FILENO, ep->reg([](epoll_event const &e) {
           if (e.events & EPOLLERR || e.events & EPOLLHUP) {
             std::cout << "bye!" << std::endl;
@@ -373,7 +1629,37 @@ int main(int argc, char **argv) {
           if (nread <= 0) { ep->shutdown(); }
           rl_callback_read_char();
         }));
-      });
+      };
+
+      // log lines are appended as they arrive on the one loop, which keeps the merged view in arrival order
+      for (auto &item : services) {
+        item.client->start()
+            .then([&item] {
+              item.connected = true;
+              through(item, [&] {
+                core.log >> [&item](LogEntry const &entry) {
+                  if (!log_settings().accepts(entry.level, entry.tag)) return;
+                  if (frame_logs >= attach_frame_lines) {
+                    dropped++;
+                    return;
+                  }
+                  frame_logs++;
+                  if (tagged) frame.append(label(item));
+                  frame.append(print_level(entry.level)).append(" [").append(entry.tag).append("] ").append(entry.content).append("\033[0m\n");
+                  schedule();
+                };
+              });
+              ready();
+            })
+            .fail([&item](std::exception_ptr e) {
+              try {
+                if (e) std::rethrow_exception(e);
+              } catch (std::exception &ex) {
+                std::cerr << item.name << ": " << ex.what() << std::endl;
+              }
+              ready();
+            });
+      }
       ep->wait();
     });
   });
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <errno.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "hash.hpp"
+#include "pool.hpp"
+
+// What an extraction produced, keyed by the path relative to the component root.
+// mode carries the file type bits as well, hash is xxh64 of the content (of the target for symlinks).
+struct manifest_entry {
+  uint64_t size;
+  mode_t mode;
+  time_t mtime;
+  uint64_t hash;
+};
+
+using manifest = std::unordered_map<std::string, manifest_entry>;
+
+// Paths in an installed tree that the archive did not produce but that belong there: the mount points stonectl
+// creates and the runtime files carried over from the previous version. They are recorded without type bits and
+// only their place in the tree is known, neither presence nor content is verified.
+inline manifest_entry untracked_entry() { return { 0, 0, 0, 0 }; }
+inline bool is_untracked(manifest_entry const &entry) { return entry.mode == 0; }
+
+// one entry per line: hash size mode mtime path
+inline manifest read_manifest(std::filesystem::path const &file) {
+  manifest ret;
+  FILE *fp = fopen(file.c_str(), "r");
+  if (!fp) return ret;
+  char *line = nullptr;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, fp)) > 0) {
+    if (line[len - 1] == '\n') line[--len] = '\0';
+    manifest_entry entry;
+    unsigned mode;
+    long long mtime;
+    int consumed = 0;
+    if (sscanf(line, "%" SCNx64 " %" SCNu64 " %o %lld %n", &entry.hash, &entry.size, &mode, &mtime, &consumed) != 4 || consumed == 0) continue;
+    entry.mode           = mode;
+    entry.mtime          = mtime;
+    ret[line + consumed] = entry;
+  }
+  free(line);
+  fclose(fp);
+  return ret;
+}
+
+inline void write_manifest(std::filesystem::path const &file, manifest const &data) {
+  std::vector<manifest::const_iterator> sorted;
+  sorted.reserve(data.size());
+  for (auto it = data.begin(); it != data.end(); ++it) sorted.push_back(it);
+  std::sort(sorted.begin(), sorted.end(), [](auto a, auto b) { return a->first < b->first; });
+  auto temp = file.string() + ".tmp";
+  FILE *fp  = fopen(temp.c_str(), "w");
+  if (!fp) throw std::runtime_error("Failed to write manifest: " + temp);
+  for (auto it : sorted)
+    fprintf(fp, "%016" PRIx64 " %" PRIu64 " %o %lld %s\n", it->second.hash, it->second.size, (unsigned)it->second.mode, (long long)it->second.mtime,
+            it->first.c_str());
+  fclose(fp);
+  std::filesystem::rename(temp, file);
+}
+
+struct verify_report {
+  std::vector<std::string> missing, extra, modified;
+  uint64_t bytes = 0;
+  size_t files   = 0;
+
+  bool clean() const { return missing.empty() && extra.empty() && modified.empty(); }
+};
+
+// Compares the tree under root with the manifest written when it was extracted. Sizes, types and link targets are
+// checked during the walk; file contents are hashed on jobs threads with large sequential reads, largest files first
+// so the longest hash does not start last.
+inline verify_report verify_tree(std::filesystem::path const &root, manifest const &expected, unsigned jobs) {
+  using namespace std::filesystem;
+  verify_report report;
+  std::vector<std::pair<std::string, manifest_entry const *>> pending;
+  std::unordered_map<std::string, bool> seen;
+  seen.reserve(expected.size());
+  std::error_code ec;
+  for (auto it = recursive_directory_iterator(root, ec); !ec && it != recursive_directory_iterator(); it.increment(ec)) {
+    auto rel   = it->path().lexically_relative(root).string();
+    auto found = expected.find(rel);
+    if (found == expected.end()) {
+      report.extra.push_back(rel);
+      if (it->is_directory(ec) && !it->is_symlink(ec)) it.disable_recursion_pending();
+      continue;
+    }
+    seen[rel]   = true;
+    auto &entry = found->second;
+    if (is_untracked(entry)) {
+      if (it->is_directory(ec) && !it->is_symlink(ec)) it.disable_recursion_pending();
+      continue;
+    }
+    struct stat st;
+    if (lstat(it->path().c_str(), &st) != 0 || (st.st_mode & S_IFMT) != (entry.mode & S_IFMT)) {
+      report.modified.push_back(rel);
+      continue;
+    }
+    if (S_ISLNK(st.st_mode)) {
+      auto target = read_symlink(it->path(), ec).string();
+      xxh64 hasher;
+      hasher.update(target.data(), target.size());
+      if (ec || hasher.digest() != entry.hash) report.modified.push_back(rel);
+    } else if (S_ISREG(st.st_mode)) {
+      if ((uint64_t)st.st_size != entry.size)
+        report.modified.push_back(rel);
+      else
+        pending.emplace_back(rel, &entry);
+    }
+  }
+  if (ec) throw std::runtime_error("Failed to walk " + root.string() + ": " + ec.message());
+  for (auto &[rel, entry] : expected)
+    if (rel != "." && !is_untracked(entry) && !seen.count(rel)) report.missing.push_back(rel);
+
+  std::sort(pending.begin(), pending.end(), [](auto &a, auto &b) { return a.second->size > b.second->size; });
+  std::mutex mtx;
+  {
+    worker_pool pool{ jobs };
+    for (auto &[rel, entry] : pending) {
+      pool.submit([&, rel = rel, entry = entry] {
+        constexpr size_t buffer_size = 1 << 20;
+        thread_local std::unique_ptr<char[]> buffer{ new char[buffer_size] };
+        xxh64 hasher;
+        bool ok = false;
+        int fd  = ::open((root / rel).c_str(), O_RDONLY | O_CLOEXEC | O_NOATIME);
+        if (fd < 0) fd = ::open((root / rel).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+          posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+          ssize_t got;
+          uint64_t total = 0;
+          while (true) {
+            got = read(fd, buffer.get(), buffer_size);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) break;
+            hasher.update(buffer.get(), got);
+            total += got;
+          }
+          close(fd);
+          ok = got == 0 && total == entry->size && hasher.digest() == entry->hash;
+        }
+        std::lock_guard lock{ mtx };
+        report.bytes += entry->size;
+        report.files++;
+        if (!ok) report.modified.push_back(rel);
+      });
+    }
+    pool.wait_idle();
+  }
+  for (auto list : { &report.missing, &report.extra, &report.modified }) std::sort(list->begin(), list->end());
+  return report;
+}
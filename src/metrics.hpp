@@ -0,0 +1,148 @@
+#pragma once
+
+#include <errno.h>
+#include <memory>
+#include <netdb.h>
+#include <rpcws.hpp>
+#include <stdexcept>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+// --listen accepts unix:/path/to/socket or host:port, [v6addr]:port for ipv6
+inline int listen_address(std::string const &address) {
+  int fd;
+  if (address.rfind("unix:", 0) == 0) {
+    auto path = address.substr(5);
+    sockaddr_un addr{};
+    if (path.empty() || path.size() >= sizeof addr.sun_path) throw std::runtime_error("Invalid socket path: " + path);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    // a socket file left behind by a previous exporter
+    unlink(path.c_str());
+    if (fd < 0 || bind(fd, (sockaddr *)&addr, sizeof addr) != 0) throw std::runtime_error("Failed to bind " + address + ": " + strerror(errno));
+  } else {
+    auto colon = address.rfind(':');
+    if (colon == std::string::npos) throw std::runtime_error("Invalid listen address: " + address);
+    auto host = address.substr(0, colon), port = address.substr(colon + 1);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+    addrinfo hints{}, *result;
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE | AI_NUMERICSERV;
+    if (int ret = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result); ret != 0)
+      throw std::runtime_error("Invalid listen address " + address + ": " + gai_strerror(ret));
+    fd = socket(result->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    bool bound = fd >= 0 && bind(fd, result->ai_addr, result->ai_addrlen) == 0;
+    freeaddrinfo(result);
+    if (!bound) throw std::runtime_error("Failed to bind " + address + ": " + strerror(errno));
+  }
+  if (listen(fd, 64) != 0) throw std::runtime_error("Failed to listen on " + address + ": " + strerror(errno));
+  return fd;
+}
+
+// Minimal HTTP/1.x server answering every request with the current contents of body, driven by the rpcws loop.
+// Handlers are registered once per connection slot and reused, so a long-lived exporter does not grow
+// the loop's handler table with every scrape.
+class metrics_server {
+  struct slot {
+    int fd = -1;
+    std::string request;
+    // what is left to send once the socket becomes writable again
+    std::string response;
+    size_t sent = 0;
+    uint64_t handler;
+  };
+
+  std::shared_ptr<rpcws::epoll> ep;
+  int listener;
+  std::string const &body;
+  std::vector<std::unique_ptr<slot>> slots;
+  std::vector<slot *> idle;
+
+  void close_slot(slot &item) {
+    ep->del(item.fd);
+    close(item.fd);
+    item.fd = -1;
+    item.request.clear();
+    item.response.clear();
+    item.sent = 0;
+    idle.push_back(&item);
+  }
+
+  // the body is copied into the slot, so a slow reader is served from EPOLLOUT without holding up the loop
+  void respond(slot &item) {
+    auto &text    = body;
+    item.response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(text.size()) +
+                    "\r\nConnection: close\r\n\r\n";
+    if (item.request.rfind("HEAD ", 0) != 0) item.response += text;
+    item.sent = 0;
+    if (!flush(item)) {
+      ep->del(item.fd);
+      ep->add(EPOLLOUT, item.fd, item.handler);
+      return;
+    }
+    close_slot(item);
+  }
+
+  // returns false while part of the response still waits for the socket
+  bool flush(slot &item) {
+    while (item.sent < item.response.size()) {
+      auto ret = send(item.fd, item.response.data() + item.sent, item.response.size() - item.sent, MSG_NOSIGNAL);
+      if (ret < 0 && errno == EINTR) continue;
+      if (ret < 0 && errno == EAGAIN) return false;
+      // the scraper went away, nothing left to deliver
+      if (ret <= 0) return true;
+      item.sent += ret;
+    }
+    return true;
+  }
+
+  void writable(slot &item) {
+    if (flush(item)) close_slot(item);
+  }
+
+  void readable(slot &item) {
+    char buf[4096];
+    while (true) {
+      auto ret = recv(item.fd, buf, sizeof buf, 0);
+      if (ret < 0 && errno == EINTR) continue;
+      if (ret < 0 && errno == EAGAIN) return;
+      if (ret <= 0) return close_slot(item);
+      item.request.append(buf, ret);
+      if (item.request.find("\r\n\r\n") != std::string::npos) return respond(item);
+      if (item.request.size() > 16384) return close_slot(item);
+    }
+  }
+
+  void accept_all() {
+    while (true) {
+      int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) return;
+      if (idle.empty()) {
+        auto &item   = *slots.emplace_back(std::make_unique<slot>());
+        item.handler = ep->reg([this, &item](epoll_event const &) { item.response.empty() ? readable(item) : writable(item); });
+        idle.push_back(&item);
+      }
+      auto item = idle.back();
+      idle.pop_back();
+      item->fd = fd;
+      ep->add(EPOLLIN, fd, item->handler);
+    }
+  }
+
+public:
+  metrics_server(std::shared_ptr<rpcws::epoll> ep, int listener, std::string const &body)
+      : ep(std::move(ep))
+      , listener(listener)
+      , body(body) {
+    this->ep->add(EPOLLIN, listener, this->ep->reg([this](epoll_event const &) { accept_all(); }));
+  }
+  metrics_server(metrics_server const &) = delete;
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Fixed-size thread pool; jobs run in submission order on whichever worker is free
+class worker_pool {
+  std::vector<std::thread> threads;
+  std::deque<std::function<void()>> jobs;
+  std::mutex mtx;
+  std::condition_variable cv, idle_cv;
+  size_t running = 0;
+  bool stopping  = false;
+
+  void run() {
+    std::unique_lock lock{ mtx };
+    while (true) {
+      cv.wait(lock, [&] { return stopping || !jobs.empty(); });
+      if (jobs.empty()) return;
+      auto job = std::move(jobs.front());
+      jobs.pop_front();
+      running++;
+      lock.unlock();
+      job();
+      lock.lock();
+      running--;
+      if (running == 0 && jobs.empty()) idle_cv.notify_all();
+    }
+  }
+
+public:
+  worker_pool(size_t count) {
+    if (count == 0) count = 1;
+    for (size_t i = 0; i < count; i++) threads.emplace_back([this] { run(); });
+  }
+  worker_pool(worker_pool const &) = delete;
+  ~worker_pool() {
+    {
+      std::lock_guard lock{ mtx };
+      stopping = true;
+    }
+    cv.notify_all();
+    for (auto &thread : threads) thread.join();
+  }
+
+  void submit(std::function<void()> job) {
+    {
+      std::lock_guard lock{ mtx };
+      jobs.emplace_back(std::move(job));
+    }
+    cv.notify_one();
+  }
+
+  bool busy() {
+    std::lock_guard lock{ mtx };
+    return running || !jobs.empty();
+  }
+
+  void wait_idle() {
+    std::unique_lock lock{ mtx };
+    idle_cv.wait(lock, [&] { return running == 0 && jobs.empty(); });
+  }
+};
+
+// Bounded byte queue between a producer that must never block (curl callbacks) and a blocking consumer
+class chunk_queue {
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::deque<std::vector<char>> chunks;
+  size_t bytes = 0, limit;
+  bool closed  = false;
+
+public:
+  chunk_queue(size_t limit)
+      : limit(limit) {}
+
+  // Rejects the chunk when the queue is full; the caller is expected to retry later
+  bool try_push(char const *data, size_t size) {
+    {
+      std::lock_guard lock{ mtx };
+      if (bytes && bytes + size > limit) return false;
+      chunks.emplace_back(data, data + size);
+      bytes += size;
+    }
+    cv.notify_one();
+    return true;
+  }
+
+  // Blocks until a chunk is available, returns false once the queue is closed and drained
+  bool pop(std::vector<char> &out) {
+    std::unique_lock lock{ mtx };
+    cv.wait(lock, [&] { return closed || !chunks.empty(); });
+    if (chunks.empty()) return false;
+    out = std::move(chunks.front());
+    chunks.pop_front();
+    bytes -= out.size();
+    return true;
+  }
+
+  bool has_room() {
+    std::lock_guard lock{ mtx };
+    return bytes <= limit / 2;
+  }
+
+  void close() {
+    {
+      std::lock_guard lock{ mtx };
+      closed = true;
+    }
+    cv.notify_all();
+  }
+};
+
+// eventfd used by workers to wake up an event loop that only polls file descriptors
+inline int notify_fd() {
+  static int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  return fd;
+}
+
+inline void notify() {
+  uint64_t one = 1;
+  (void)!write(notify_fd(), &one, sizeof one);
+}
+
+inline void notify_reset() {
+  uint64_t val;
+  (void)!read(notify_fd(), &val, sizeof val);
+}
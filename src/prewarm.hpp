@@ -0,0 +1,232 @@
+#pragma once
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <errno.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <map>
+#include <stdexcept>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "pool.hpp"
+
+// A byte range of an installed file, path relative to .stone (core/... or game/...)
+struct prewarm_range {
+  std::string path;
+  uint64_t offset, length;
+};
+
+// The ranges a startup faulted in, in the order it needed them, and how long that startup took from a cold cache
+struct prewarm_profile {
+  long long cold_ms = 0;
+  std::vector<prewarm_range> ranges;
+};
+
+// "# cold <ms>" once, then one range per line: offset length path
+inline prewarm_profile read_prewarm_profile(std::filesystem::path const &file) {
+  prewarm_profile ret;
+  FILE *fp = fopen(file.c_str(), "r");
+  if (!fp) return ret;
+  char *line = nullptr;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, fp)) > 0) {
+    if (line[len - 1] == '\n') line[--len] = '\0';
+    long long cold;
+    unsigned long long offset, length;
+    int consumed = 0;
+    if (sscanf(line, "# cold %lld", &cold) == 1)
+      ret.cold_ms = cold;
+    else if (line[0] != '#' && sscanf(line, "%llu %llu %n", &offset, &length, &consumed) == 2 && consumed != 0)
+      ret.ranges.push_back({ line + consumed, offset, length });
+  }
+  free(line);
+  fclose(fp);
+  return ret;
+}
+
+inline void write_prewarm_profile(std::filesystem::path const &file, prewarm_profile const &data) {
+  auto temp = file.string() + ".tmp";
+  FILE *fp  = fopen(temp.c_str(), "w");
+  if (!fp) throw std::runtime_error("Failed to write prewarm profile: " + temp);
+  fprintf(fp, "# cold %lld\n", data.cold_ms);
+  for (auto &range : data.ranges) fprintf(fp, "%llu %llu %s\n", (unsigned long long)range.offset, (unsigned long long)range.length, range.path.c_str());
+  fclose(fp);
+  std::filesystem::rename(temp, file);
+}
+
+// Every regular file of the trees under base, largest first; what gets prewarmed when no profile was recorded yet
+inline prewarm_profile full_prewarm_profile(std::filesystem::path const &base, std::vector<std::string> const &trees) {
+  using namespace std::filesystem;
+  prewarm_profile ret;
+  std::error_code ec;
+  for (auto &tree : trees)
+    for (auto it = recursive_directory_iterator(base / tree, ec); !ec && it != recursive_directory_iterator(); it.increment(ec))
+      if (it->is_regular_file(ec) && !it->is_symlink(ec)) ret.ranges.push_back({ it->path().lexically_relative(base).string(), 0, it->file_size(ec) });
+  std::sort(ret.ranges.begin(), ret.ranges.end(), [](auto &a, auto &b) { return a.length > b.length; });
+  return ret;
+}
+
+struct prewarm_stats {
+  size_t ranges = 0, files = 0, missing = 0;
+  uint64_t bytes = 0, uncached = 0;
+};
+
+// Pulls the profile into the page cache on jobs threads. Ranges are split into pieces and queued in profile order,
+// so what the startup needs first is read first while the device still gets enough requests in flight.
+// mincore tells how much was not cached yet; readahead blocks until the reads are issued, posix_fadvise takes over
+// where it is not supported.
+inline prewarm_stats prewarm(std::filesystem::path const &base, prewarm_profile const &profile, unsigned jobs) {
+  constexpr uint64_t piece = 2 << 20;
+  static uint64_t const page_size = sysconf(_SC_PAGESIZE);
+  prewarm_stats stats;
+  std::map<std::string, std::pair<int, uint64_t>> files;
+  std::atomic<uint64_t> uncached{ 0 };
+  {
+    worker_pool pool{ jobs };
+    for (auto &range : profile.ranges) {
+      auto [it, inserted] = files.try_emplace(range.path, -1, 0);
+      if (inserted) {
+        int fd = ::open((base / range.path).c_str(), O_RDONLY | O_CLOEXEC | O_NOATIME);
+        if (fd < 0) fd = ::open((base / range.path).c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0) {
+          it->second = { fd, (uint64_t)st.st_size };
+          stats.files++;
+        } else {
+          if (fd >= 0) close(fd);
+          stats.missing++;
+        }
+      }
+      auto [fd, size] = it->second;
+      // a profile from before an upgrade may point past the end of the current file
+      if (fd < 0 || range.offset >= size) continue;
+      auto end = std::min(size, range.offset + range.length);
+      stats.ranges++;
+      stats.bytes += end - range.offset;
+      for (auto offset = range.offset & ~(page_size - 1); offset < end; offset += piece) {
+        auto length = std::min(piece, end - offset);
+        pool.submit([&uncached, fd = fd, offset, length] {
+          std::vector<unsigned char> pages((length + page_size - 1) / page_size);
+          void *map = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, offset);
+          if (map != MAP_FAILED) {
+            bool ok = mincore(map, length, pages.data()) == 0;
+            munmap(map, length);
+            if (ok) {
+              uint64_t missing = std::count_if(pages.begin(), pages.end(), [](unsigned char page) { return !(page & 1); });
+              if (missing == 0) return;
+              uncached += missing * page_size;
+            }
+          }
+          if (readahead(fd, offset, length) != 0) posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+        });
+      }
+    }
+    pool.wait_idle();
+  }
+  for (auto &[path, file] : files)
+    if (file.first >= 0) close(file.first);
+  stats.uncached = std::min<uint64_t>(uncached, stats.bytes);
+  return stats;
+}
+
+// Drops the clean cached pages of the trees, so a recorded startup reads from disk. Pages mapped by a running
+// process stay, the returned byte count says how much could not be evicted.
+inline uint64_t evict_trees(std::filesystem::path const &base, std::vector<std::string> const &trees) {
+  auto all           = full_prewarm_profile(base, trees);
+  uint64_t remaining = 0;
+  static uint64_t const page_size = sysconf(_SC_PAGESIZE);
+  for (auto &range : all.ranges) {
+    int fd = ::open((base / range.path).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) continue;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    if (range.length) {
+      void *map = mmap(nullptr, range.length, PROT_READ, MAP_SHARED, fd, 0);
+      if (map != MAP_FAILED) {
+        std::vector<unsigned char> pages((range.length + page_size - 1) / page_size);
+        if (mincore(map, range.length, pages.data()) == 0)
+          remaining += std::count_if(pages.begin(), pages.end(), [](unsigned char page) { return page & 1; }) * page_size;
+        munmap(map, range.length);
+      }
+    }
+    close(fd);
+  }
+  return remaining;
+}
+
+// Watches the page cache residency of the trees during a startup. Every file stays mapped (without faulting anything
+// in) so a sample is one mincore per file; the first sample a page shows up in orders it in the profile.
+class residency_recorder {
+  struct file {
+    std::string path;
+    void *map;
+    uint64_t size;
+    std::vector<unsigned char> pages;
+    std::vector<int> first_seen;
+  };
+  std::vector<file> files;
+  int ticks = 0;
+
+public:
+  residency_recorder(std::filesystem::path const &base, std::vector<std::string> const &trees) {
+    static uint64_t const page_size = sysconf(_SC_PAGESIZE);
+    for (auto &range : full_prewarm_profile(base, trees).ranges) {
+      if (range.length == 0) continue;
+      int fd = ::open((base / range.path).c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) continue;
+      void *map = mmap(nullptr, range.length, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+      if (map == MAP_FAILED) continue;
+      auto count = (range.length + page_size - 1) / page_size;
+      files.push_back({ range.path, map, range.length, std::vector<unsigned char>(count), std::vector<int>(count, -1) });
+    }
+  }
+  residency_recorder(residency_recorder const &) = delete;
+  ~residency_recorder() {
+    for (auto &item : files) munmap(item.map, item.size);
+  }
+
+  // returns the bytes that became resident since the previous sample
+  uint64_t sample() {
+    static uint64_t const page_size = sysconf(_SC_PAGESIZE);
+    uint64_t added = 0;
+    for (auto &item : files) {
+      if (mincore(item.map, item.size, item.pages.data()) != 0) continue;
+      for (size_t i = 0; i < item.pages.size(); i++)
+        if ((item.pages[i] & 1) && item.first_seen[i] < 0) {
+          item.first_seen[i] = ticks;
+          added += page_size;
+        }
+    }
+    ticks++;
+    return added;
+  }
+
+  // runs of pages that showed up in the same sample, earliest sample first
+  prewarm_profile profile(long long cold_ms) const {
+    static uint64_t const page_size = sysconf(_SC_PAGESIZE);
+    std::vector<std::pair<int, prewarm_range>> runs;
+    for (auto &item : files)
+      for (size_t i = 0; i < item.first_seen.size();) {
+        size_t j = i + 1;
+        while (j < item.first_seen.size() && item.first_seen[j] == item.first_seen[i]) j++;
+        if (item.first_seen[i] >= 0) runs.push_back({ item.first_seen[i], { item.path, i * page_size, std::min(j * page_size, item.size) - i * page_size } });
+        i = j;
+      }
+    std::stable_sort(runs.begin(), runs.end(), [](auto &a, auto &b) { return a.first < b.first; });
+    prewarm_profile ret;
+    ret.cold_ms = cold_ms;
+    for (auto &[tick, range] : runs) ret.ranges.push_back(std::move(range));
+    return ret;
+  }
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/types.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Resource usage of a set of processes, summed; cpu in clock ticks, io in bytes read and written to storage
+struct proc_usage {
+  uint64_t cpu_ticks = 0, rss_bytes = 0, io_bytes = 0;
+  size_t processes   = 0;
+};
+
+namespace procstat_detail {
+
+// reads the whole (small) proc file into buf, returns false once the process is gone
+inline bool read_at_zero(int fd, char *buf, size_t size) {
+  if (fd < 0) return false;
+  auto ret = pread(fd, buf, size - 1, 0);
+  if (ret <= 0) return false;
+  buf[ret] = '\0';
+  return true;
+}
+
+inline char const *skip_fields(char const *p, int count) {
+  while (count--) {
+    while (*p == ' ') p++;
+    while (*p && *p != ' ') p++;
+  }
+  return p;
+}
+
+inline uint64_t field_after(char const *buf, char const *key) {
+  auto p = strstr(buf, key);
+  return p ? strtoull(p + strlen(key), nullptr, 10) : 0;
+}
+
+} // namespace procstat_detail
+
+// The stat, statm and io files of one process, opened once and re-read with pread on every sample.
+// The descriptors stay bound to the process they were opened for, so a recycled pid reads as dead.
+class proc_handle {
+  int stat_fd = -1, statm_fd = -1, io_fd = -1;
+
+  static int open_at(int dir, char const *name) { return dir < 0 ? -1 : openat(dir, name, O_RDONLY | O_CLOEXEC); }
+
+public:
+  explicit proc_handle(pid_t pid) {
+    char path[32];
+    snprintf(path, sizeof path, "/proc/%d", (int)pid);
+    int dir  = ::open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    stat_fd  = open_at(dir, "stat");
+    statm_fd = open_at(dir, "statm");
+    // io needs ptrace access to the process, usage is reported without it when denied
+    io_fd = open_at(dir, "io");
+    if (dir >= 0) close(dir);
+  }
+  proc_handle(proc_handle &&rhs)
+      : stat_fd(std::exchange(rhs.stat_fd, -1))
+      , statm_fd(std::exchange(rhs.statm_fd, -1))
+      , io_fd(std::exchange(rhs.io_fd, -1)) {}
+  proc_handle &operator=(proc_handle &&rhs) {
+    std::swap(stat_fd, rhs.stat_fd);
+    std::swap(statm_fd, rhs.statm_fd);
+    std::swap(io_fd, rhs.io_fd);
+    return *this;
+  }
+  proc_handle(proc_handle const &) = delete;
+  ~proc_handle() {
+    for (int fd : { stat_fd, statm_fd, io_fd })
+      if (fd >= 0) close(fd);
+  }
+
+  // adds the usage of the process to acc, false when it has exited
+  bool sample(proc_usage &acc) {
+    using namespace procstat_detail;
+    char buf[1024];
+    if (!read_at_zero(stat_fd, buf, sizeof buf)) return false;
+    // the command name may contain spaces and parentheses, the fields start after the last ')'
+    auto p = strrchr(buf, ')');
+    if (!p) return false;
+    // utime and stime are the 14th and 15th fields, the state is the 3rd
+    char *end;
+    auto utime = strtoull(skip_fields(p + 1, 11), &end, 10);
+    auto stime = strtoull(end, nullptr, 10);
+    acc.cpu_ticks += utime + stime;
+    static uint64_t const page_size = sysconf(_SC_PAGESIZE);
+    if (read_at_zero(statm_fd, buf, sizeof buf)) acc.rss_bytes += strtoull(skip_fields(buf, 1), nullptr, 10) * page_size;
+    if (read_at_zero(io_fd, buf, sizeof buf)) acc.io_bytes += field_after(buf, "read_bytes: ") + field_after(buf, "write_bytes: ");
+    acc.processes++;
+    return true;
+  }
+};
+
+// The processes of one service, kept open across samples and reconciled when the tree is rescanned
+class process_group {
+  std::vector<std::pair<pid_t, proc_handle>> members;
+
+public:
+  void assign(std::vector<pid_t> const &pids) {
+    std::vector<std::pair<pid_t, proc_handle>> next;
+    next.reserve(pids.size());
+    for (auto pid : pids) {
+      auto it = std::find_if(members.begin(), members.end(), [&](auto &item) { return item.first == pid; });
+      if (it != members.end())
+        next.emplace_back(pid, std::move(it->second));
+      else
+        next.emplace_back(pid, proc_handle{ pid });
+    }
+    members = std::move(next);
+  }
+
+  bool empty() const { return members.empty(); }
+
+  proc_usage sample() {
+    proc_usage ret;
+    members.erase(std::remove_if(members.begin(), members.end(), [&](auto &item) { return !item.second.sample(ret); }), members.end());
+    return ret;
+  }
+};
+
+// parent -> children of every process, gathered in one pass over /proc
+inline std::unordered_map<pid_t, std::vector<pid_t>> process_children() {
+  std::unordered_map<pid_t, std::vector<pid_t>> ret;
+  DIR *dir = opendir("/proc");
+  if (!dir) return ret;
+  char path[64], buf[512];
+  while (auto item = readdir(dir)) {
+    if (item->d_name[0] < '0' || item->d_name[0] > '9') continue;
+    snprintf(path, sizeof path, "/proc/%s/stat", item->d_name);
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) continue;
+    bool ok = procstat_detail::read_at_zero(fd, buf, sizeof buf);
+    close(fd);
+    char const *p = ok ? strrchr(buf, ')') : nullptr;
+    if (!p) continue;
+    // ppid is the field after the state
+    ret[(pid_t)strtol(procstat_detail::skip_fields(p + 1, 1), nullptr, 10)].push_back((pid_t)atoi(item->d_name));
+  }
+  closedir(dir);
+  return ret;
+}
+
+inline std::vector<pid_t> process_tree(pid_t root, std::unordered_map<pid_t, std::vector<pid_t>> const &children) {
+  std::vector<pid_t> ret{ root };
+  for (size_t i = 0; i < ret.size(); i++)
+    if (auto it = children.find(ret[i]); it != children.end()) ret.insert(ret.end(), it->second.begin(), it->second.end());
+  return ret;
+}
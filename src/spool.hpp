@@ -0,0 +1,143 @@
+#pragma once
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <condition_variable>
+#include <cstdint>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <stdexcept>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Disk-backed buffer for a body fetched as several parallel ranges. Each range is written at its final
+// offset as it arrives, while a single reader consumes the ranges strictly in order, blocking until the
+// bytes it needs have landed.
+class range_spool {
+  struct segment {
+    uint64_t begin, end, filled;
+  };
+
+  int fd;
+  uint64_t length;
+  size_t chunk;
+  std::vector<segment> segments;
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool aborted = false;
+  std::string message;
+
+  static int open_temp(char const *dir) {
+    int fd = ::open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) return fd;
+    // O_TMPFILE is not supported by every filesystem
+    std::string name = std::string(dir) + "/.spool.XXXXXX";
+    fd               = mkostemp(name.data(), O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error(std::string("Failed to create spool: ") + strerror(errno));
+    unlink(name.c_str());
+    return fd;
+  }
+
+public:
+  range_spool(char const *dir, uint64_t length, size_t count, size_t chunk)
+      : fd(open_temp(dir))
+      , length(length)
+      , chunk(chunk) {
+    uint64_t step = length / count;
+    for (size_t i = 0; i < count; i++) segments.push_back({ i * step, i + 1 == count ? length : (i + 1) * step, 0 });
+    // reserving the space up front keeps the out-of-order writes from fragmenting the file
+    fallocate(fd, 0, 0, length);
+  }
+  range_spool(range_spool const &) = delete;
+  ~range_spool() { discard(); }
+
+  size_t count() const { return segments.size(); }
+  uint64_t total() const { return length; }
+  std::pair<uint64_t, uint64_t> range(size_t index) const { return { segments[index].begin, segments[index].end }; }
+
+  uint64_t received() {
+    std::lock_guard lock{ mtx };
+    uint64_t sum = 0;
+    for (auto &seg : segments) sum += seg.filled;
+    return sum;
+  }
+
+  // only the transfer owning the segment writes to it
+  bool write(size_t index, char const *data, size_t size) {
+    auto &seg   = segments[index];
+    auto offset = seg.begin + seg.filled;
+    if (offset + size > seg.end) return false;
+    while (size) {
+      auto ret = pwrite(fd, data, size, offset);
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      data += ret;
+      size -= ret;
+      offset += ret;
+      {
+        std::lock_guard lock{ mtx };
+        seg.filled += ret;
+      }
+      cv.notify_all();
+    }
+    return true;
+  }
+
+  bool complete(size_t index) {
+    std::lock_guard lock{ mtx };
+    return segments[index].begin + segments[index].filled == segments[index].end;
+  }
+
+  void abort(std::string reason) {
+    {
+      std::lock_guard lock{ mtx };
+      if (aborted) return;
+      aborted = true;
+      message = std::move(reason);
+    }
+    cv.notify_all();
+  }
+
+  std::string error() {
+    std::lock_guard lock{ mtx };
+    return message;
+  }
+
+  // feeds the segment to the callback in order, returns false if the download was aborted
+  template <typename F> bool drain(size_t index, F feed) {
+    auto &seg         = segments[index];
+    uint64_t consumed = 0, size = seg.end - seg.begin;
+    std::vector<char> buffer(chunk);
+    while (consumed < size) {
+      uint64_t available;
+      {
+        std::unique_lock lock{ mtx };
+        cv.wait(lock, [&] { return aborted || seg.filled > consumed; });
+        if (aborted) return false;
+        available = seg.filled - consumed;
+      }
+      auto ret = pread(fd, buffer.data(), std::min<uint64_t>(available, chunk), seg.begin + consumed);
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        throw std::runtime_error(std::string("Failed to read spool: ") + strerror(errno));
+      }
+      feed(buffer.data(), ret);
+      consumed += ret;
+    }
+    return true;
+  }
+
+  // drops the backing storage early, the bookkeeping stays valid for late completion callbacks
+  void discard() {
+    std::lock_guard lock{ mtx };
+    if (fd >= 0) close(fd);
+    fd = -1;
+  }
+};
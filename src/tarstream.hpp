@@ -0,0 +1,544 @@
+#pragma once
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <errno.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <stdexcept>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <vector>
+
+#include "decompress.hpp"
+#include "hash.hpp"
+#include "manifest.hpp"
+#include "writers.hpp"
+
+struct tar_header {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char padding[12];
+};
+static_assert(sizeof(tar_header) == 512, "tar header must be one block");
+
+inline uint64_t tar_number(char const *field, size_t len) {
+  uint64_t ret = 0;
+  if (field[0] & 0x80) {
+    // GNU base-256 extension for values that do not fit in octal
+    ret = field[0] & 0x7f;
+    for (size_t i = 1; i < len; i++) ret = (ret << 8) | (unsigned char)field[i];
+    return ret;
+  }
+  size_t i = 0;
+  while (i < len && (field[i] == ' ' || field[i] == '\0')) i++;
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) ret = (ret << 3) | (field[i] - '0');
+  return ret;
+}
+
+inline std::string tar_string(char const *field, size_t len) { return std::string(field, strnlen(field, len)); }
+
+// Push-mode tar parser: bytes are fed as they arrive and entries are written to disk immediately,
+// so no part of the archive has to be buffered beyond the current header block.
+// The archive is extracted into prefix as a fresh staging tree next to the reference tree (the installed version).
+// Given the manifest of the previous extraction it works incrementally: a file whose metadata matches both the
+// manifest and the reference is compared against the incoming bytes and hard-linked instead of rewritten; the
+// reference stays intact and publishing the staging tree is up to the caller.
+// With writers, file bodies are written by a pool of threads while this one keeps parsing; when the archive
+// sits in a seekable file (extract_fd) the bodies are copied from it with copy_file_range.
+class tar_stream {
+  enum class state_t { header, body, meta, skip, end };
+
+  struct entry {
+    std::string path, link;
+    char type;
+    mode_t mode;
+    time_t mtime;
+    uint64_t size;
+    dev_t dev;
+  };
+
+  std::filesystem::path prefix, reference;
+  bool committed = false;
+  state_t state = state_t::header;
+  char block[512];
+  size_t entries     = 0;
+  size_t filled      = 0;
+  uint64_t remain    = 0;
+  uint64_t padding   = 0;
+  int zero_blocks    = 0;
+  int fd             = -1;
+  char meta_type     = 0;
+  std::string meta;
+  std::string long_name, long_link;
+  uint64_t pax_size = 0;
+  bool has_pax_size = false;
+  entry current;
+
+  manifest previous, produced;
+  std::string key;
+  std::filesystem::path target_path;
+  xxh64 hasher;
+  int ref_fd      = -1;
+  bool comparing  = false;
+  uint64_t offset = 0;
+  std::vector<char> compare_buffer;
+  uint64_t written = 0, skipped = 0;
+  size_t removed   = 0;
+
+  std::unique_ptr<file_writers> writers;
+  size_t lane   = 0;
+  bool deferred = false, first_job = false;
+  std::vector<char> pending;
+  int source_fd           = -1;
+  char const *source_base = nullptr;
+
+  // bodies are handed to the writers in pieces of this size
+  static constexpr size_t writer_chunk = 1 << 20;
+
+  void verify_checksum() {
+    auto &hdr         = *(tar_header const *)block;
+    uint64_t expected = tar_number(hdr.chksum, sizeof hdr.chksum);
+    uint64_t sum      = 0;
+    for (size_t i = 0; i < sizeof block; i++) sum += (unsigned char)block[i];
+    for (size_t i = 0; i < sizeof hdr.chksum; i++) sum += ' ' - (unsigned char)hdr.chksum[i];
+    if (sum != expected) throw std::runtime_error("tar header checksum mismatch");
+  }
+
+  void parse_pax() {
+    size_t pos = 0;
+    while (pos < meta.size()) {
+      auto space = meta.find(' ', pos);
+      if (space == std::string::npos) break;
+      size_t len = std::strtoul(meta.data() + pos, nullptr, 10);
+      if (len == 0 || pos + len > meta.size()) throw std::runtime_error("malformed pax header");
+      auto record = meta.substr(space + 1, pos + len - space - 2);
+      auto eq     = record.find('=');
+      if (eq != std::string::npos) {
+        auto key   = record.substr(0, eq);
+        auto value = record.substr(eq + 1);
+        if (key == "path")
+          long_name = value;
+        else if (key == "linkpath")
+          long_link = value;
+        else if (key == "size") {
+          pax_size     = std::strtoull(value.c_str(), nullptr, 10);
+          has_pax_size = true;
+        }
+      }
+      pos += len;
+    }
+  }
+
+  void on_header() {
+    bool zero = true;
+    for (char ch : block)
+      if (ch) {
+        zero = false;
+        break;
+      }
+    if (zero) {
+      if (++zero_blocks == 2) state = state_t::end;
+      return;
+    }
+    zero_blocks = 0;
+    verify_checksum();
+    auto &hdr     = *(tar_header const *)block;
+    uint64_t size = tar_number(hdr.size, sizeof hdr.size);
+    switch (hdr.typeflag) {
+    case 'L':
+    case 'K':
+    case 'x':
+    case 'g':
+      meta_type = hdr.typeflag;
+      meta.clear();
+      begin_data(state_t::meta, size);
+      return;
+    }
+    current.type  = hdr.typeflag;
+    current.mode  = tar_number(hdr.mode, sizeof hdr.mode) & 07777;
+    current.mtime = tar_number(hdr.mtime, sizeof hdr.mtime);
+    current.size  = has_pax_size ? pax_size : size;
+    current.dev   = makedev(tar_number(hdr.devmajor, sizeof hdr.devmajor), tar_number(hdr.devminor, sizeof hdr.devminor));
+    if (!long_name.empty()) {
+      current.path = long_name;
+    } else if (memcmp(hdr.magic, "ustar", 5) == 0 && hdr.prefix[0]) {
+      current.path = tar_string(hdr.prefix, sizeof hdr.prefix) + "/" + tar_string(hdr.name, sizeof hdr.name);
+    } else {
+      current.path = tar_string(hdr.name, sizeof hdr.name);
+    }
+    current.link = long_link.empty() ? tar_string(hdr.linkname, sizeof hdr.linkname) : long_link;
+    long_name.clear();
+    long_link.clear();
+    has_pax_size = false;
+    begin_entry();
+  }
+
+  void on_meta() {
+    switch (meta_type) {
+    case 'L': long_name = meta.c_str(); break;
+    case 'K': long_link = meta.c_str(); break;
+    case 'x': parse_pax(); break;
+    default: break;
+    }
+  }
+
+  void begin_data(state_t next, uint64_t size) {
+    remain  = size;
+    padding = (512 - size % 512) % 512;
+    state   = next;
+    if (remain == 0) end_data();
+  }
+
+  void end_data() {
+    switch (state) {
+    case state_t::body: end_entry(); break;
+    case state_t::meta: on_meta(); break;
+    default: break;
+    }
+    if (padding) {
+      remain  = padding;
+      padding = 0;
+      state   = state_t::skip;
+    } else {
+      state = state_t::header;
+    }
+  }
+
+  static std::string normalize(std::string const &input) {
+    auto rel = std::filesystem::path(input).relative_path().lexically_normal().string();
+    while (!rel.empty() && rel.back() == '/') rel.pop_back();
+    return rel.empty() ? "." : rel;
+  }
+
+  std::filesystem::path resolve(std::string const &input) {
+    auto rel = normalize(input);
+    for (auto &part : std::filesystem::path(rel))
+      if (part == "..") throw std::runtime_error("unsafe path in archive: " + input);
+    return prefix / rel;
+  }
+
+  // where the current version of the entry lives
+  std::filesystem::path installed_path() { return reference / key; }
+
+  bool unchanged_candidate() {
+    struct stat st;
+    if (lstat(installed_path().c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    if ((uint64_t)st.st_size != current.size || st.st_mtime != current.mtime || (st.st_mode & 07777) != current.mode) return false;
+    auto it = previous.find(key);
+    if (it == previous.end()) return true;
+    return it->second.size == current.size && it->second.mtime == current.mtime && (it->second.mode & 07777) == current.mode;
+  }
+
+  static void remove_existing(std::filesystem::path const &target) {
+    using namespace std::filesystem;
+    std::error_code ec;
+    auto st = symlink_status(target, ec);
+    if (!ec && exists(st) && !is_directory(st)) remove(target);
+  }
+
+  void begin_entry() {
+    using namespace std::filesystem;
+    path target = resolve(current.path);
+    key         = normalize(current.path);
+    entries++;
+    if (target != prefix) create_directories(target.parent_path());
+    switch (current.type) {
+    case '0':
+    case '\0':
+    case '7':
+      target_path = target;
+      hasher      = xxh64{};
+      offset      = 0;
+      comparing   = false;
+      if (unchanged_candidate()) {
+        ref_fd    = ::open(installed_path().c_str(), O_RDONLY | O_CLOEXEC);
+        comparing = ref_fd >= 0;
+      }
+      if (!comparing) {
+        remove_existing(target);
+        // the file is created here so that later hard links to it can be made right away
+        fd = ::open(target.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) throw std::runtime_error(std::string("tar extract failed: ") + strerror(errno));
+        if (writers) {
+          lane      = writers->assign();
+          deferred  = true;
+          first_job = true;
+        } else if (current.size) {
+          fallocate(fd, 0, 0, current.size);
+        }
+      }
+      begin_data(state_t::body, current.size);
+      return;
+    case '5':
+      create_directories(target);
+      chmod(target.c_str(), current.mode);
+      produced[key] = { 0, S_IFDIR | current.mode, current.mtime, 0 };
+      break;
+    case '2': {
+      std::error_code ec;
+      if (!is_symlink(symlink_status(target, ec)) || read_symlink(target, ec) != current.link) {
+        remove_existing(target);
+        if (symlink(current.link.c_str(), target.c_str()) != 0) throw std::runtime_error(std::string("tar extract failed: ") + strerror(errno));
+      }
+      xxh64 link_hash;
+      link_hash.update(current.link.data(), current.link.size());
+      produced[key] = { current.link.size(), S_IFLNK | 0777, current.mtime, link_hash.digest() };
+      break;
+    }
+    case '1': {
+      auto source = resolve(current.link);
+      std::error_code ec;
+      if (!equivalent(source, target, ec)) {
+        remove_existing(target);
+        if (link(source.c_str(), target.c_str()) != 0) throw std::runtime_error(std::string("tar extract failed: ") + strerror(errno));
+      }
+      auto it = produced.find(normalize(current.link));
+      if (it != produced.end()) produced[key] = it->second;
+      break;
+    }
+    case '3':
+    case '4':
+    case '6': {
+      remove_existing(target);
+      mode_t kind = current.type == '3' ? S_IFCHR : current.type == '4' ? S_IFBLK : S_IFIFO;
+      // device nodes need privileges we usually do not have, and the runtime bind-mounts /dev anyway
+      if (mknod(target.c_str(), kind | current.mode, current.dev) != 0 && errno != EPERM)
+        throw std::runtime_error(std::string("tar extract failed: ") + strerror(errno));
+      produced[key] = { 0, kind | current.mode, current.mtime, 0 };
+      break;
+    }
+    default: break;
+    }
+    begin_data(state_t::skip, current.size);
+  }
+
+  // the incoming bytes differ from the reference file starting at `at`: the staging file gets the matching
+  // prefix copied and continues with the archive
+  void diverge(uint64_t at) {
+    // the staging path may already be a hard link into the reference tree
+    remove_existing(target_path);
+    fd = ::open(target_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) throw std::runtime_error(std::string("tar extract failed: ") + strerror(errno));
+    if (current.size) fallocate(fd, 0, 0, current.size);
+    copy_fd_range(ref_fd, 0, fd, at);
+    ::close(ref_fd);
+    ref_fd    = -1;
+    comparing = false;
+  }
+
+  size_t matching_prefix(char const *data, size_t size) {
+    if (compare_buffer.size() < size) compare_buffer.resize(size);
+    size_t got = 0;
+    while (got < size) {
+      auto ret = pread(ref_fd, compare_buffer.data() + got, size - got, offset + got);
+      if (ret < 0 && errno == EINTR) continue;
+      if (ret <= 0) break;
+      got += ret;
+    }
+    if (got == size && memcmp(compare_buffer.data(), data, size) == 0) return size;
+    size_t same = 0;
+    while (same < got && compare_buffer[same] == data[same]) same++;
+    return same;
+  }
+
+  // links what the old tree holds beyond the previous extraction (runtime state, user files) into the new one
+  void carry_over(std::filesystem::path const &from, std::filesystem::path const &to) {
+    using namespace std::filesystem;
+    std::error_code ec;
+    std::vector<std::string> foreign;
+    for (recursive_directory_iterator it{ from, ec }, end; !ec && it != end; it.increment(ec)) {
+      auto rel = it->path().lexically_relative(from).string();
+      if (produced.count(rel)) continue;
+      if (auto found = previous.find(rel); found != previous.end() && !is_untracked(found->second)) {
+        removed++;
+        continue;
+      }
+      foreign.push_back(rel);
+      it.disable_recursion_pending();
+    }
+    for (auto &rel : foreign) {
+      create_directories((to / rel).parent_path(), ec);
+      copy(from / rel, to / rel, copy_options::recursive | copy_options::create_hard_links | copy_options::copy_symlinks, ec);
+      // recorded so the next carry over and check --verify know it belongs here
+      produced[rel] = untracked_entry();
+    }
+  }
+
+  void submit(bool last, int source = -1, uint64_t source_offset = 0, uint64_t source_size = 0) {
+    file_writers::job item;
+    item.fd            = fd;
+    item.data          = std::move(pending);
+    item.source        = source;
+    item.source_offset = source_offset;
+    item.source_size   = source_size;
+    if (first_job) item.preallocate = current.size;
+    if (last) {
+      item.last  = true;
+      item.mode  = current.mode;
+      item.mtime = current.mtime;
+    }
+    pending   = {};
+    first_job = false;
+    writers->submit(lane, std::move(item));
+  }
+
+  void write_body(char const *data, size_t size) {
+    hasher.update(data, size);
+    if (deferred) {
+      if (source_base) return submit(false, source_fd, data - source_base, size);
+      if (pending.empty()) pending.reserve(std::min<uint64_t>(current.size, writer_chunk));
+      pending.insert(pending.end(), data, data + size);
+      if (pending.size() >= writer_chunk) submit(false);
+      return;
+    }
+    if (comparing) {
+      auto same = matching_prefix(data, size);
+      offset += same;
+      if (same == size) return;
+      diverge(offset);
+      data += same;
+      size -= same;
+    }
+    write_fd(fd, data, size);
+    offset += size;
+  }
+
+  void end_entry() {
+    produced[key] = { current.size, S_IFREG | current.mode, current.mtime, hasher.digest() };
+    // an unchanged file is shared with the reference tree, or copied when it cannot be linked
+    if (comparing && link(installed_path().c_str(), target_path.c_str()) != 0) diverge(current.size);
+    if (comparing) {
+      ::close(ref_fd);
+      ref_fd    = -1;
+      comparing = false;
+      skipped += current.size;
+      return;
+    }
+    written += current.size;
+    if (deferred) {
+      submit(true);
+      fd       = -1;
+      deferred = false;
+      return;
+    }
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { current.mtime, 0 } };
+    fchmod(fd, current.mode);
+    futimens(fd, times);
+    ::close(fd);
+    fd = -1;
+  }
+
+public:
+  tar_stream(std::filesystem::path prefix, manifest previous, size_t writer_count, std::filesystem::path reference)
+      : prefix(std::move(prefix))
+      , reference(std::move(reference))
+      , previous(std::move(previous)) {
+    // leftovers of an interrupted install
+    std::filesystem::remove_all(this->prefix);
+    std::filesystem::create_directories(this->prefix);
+    if (writer_count) writers = std::make_unique<file_writers>(writer_count, 8 * writer_chunk);
+  }
+  tar_stream(tar_stream const &) = delete;
+  ~tar_stream() {
+    // let the lanes finish with the descriptors they own before closing ours
+    writers.reset();
+    if (fd >= 0) ::close(fd);
+    if (ref_fd >= 0) ::close(ref_fd);
+    if (!committed) {
+      std::error_code ec;
+      std::filesystem::remove_all(prefix, ec);
+    }
+  }
+
+  size_t count() const { return entries; }
+  uint64_t bytes_written() const { return written; }
+  uint64_t bytes_skipped() const { return skipped; }
+  size_t files_removed() const { return removed; }
+  manifest const &result() const { return produced; }
+
+  void push(char const *data, size_t size) {
+    while (size) {
+      size_t n = 0;
+      switch (state) {
+      case state_t::header:
+        n = std::min(sizeof block - filled, size);
+        memcpy(block + filled, data, n);
+        filled += n;
+        if (filled == sizeof block) {
+          filled = 0;
+          on_header();
+        }
+        break;
+      case state_t::body:
+      case state_t::meta:
+      case state_t::skip:
+        n = std::min<uint64_t>(remain, size);
+        if (state == state_t::body)
+          write_body(data, n);
+        else if (state == state_t::meta)
+          meta.append(data, n);
+        remain -= n;
+        if (remain == 0) end_data();
+        break;
+      case state_t::end: return;
+      }
+      data += n;
+      size -= n;
+    }
+  }
+
+  // extracts a complete archive held in a seekable file, e.g. the memfd of the buffered install path
+  void extract_fd(int in) {
+    struct stat st;
+    if (fstat(in, &st) != 0) throw std::runtime_error(std::string("tar extract failed: ") + strerror(errno));
+    if (st.st_size == 0) return;
+    auto base = (char const *)mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, in, 0);
+    if (base == MAP_FAILED) throw std::runtime_error(std::string("tar extract failed: ") + strerror(errno));
+    madvise((void *)base, st.st_size, MADV_SEQUENTIAL);
+    source_fd   = in;
+    source_base = base;
+    guard unmap{ [&] {
+      source_fd   = -1;
+      source_base = nullptr;
+      munmap((void *)base, st.st_size);
+    } };
+    push(base, st.st_size);
+  }
+
+  // Some writers omit the end-of-archive marker, so a clean entry boundary is accepted as well
+  void finish() {
+    if (writers) writers->drain();
+    if (state == state_t::end) return;
+    if (state == state_t::header && filled == 0) return;
+    throw std::runtime_error("tar stream is truncated");
+  }
+
+  // completes the extraction: what the reference holds beyond the previous extraction moves along
+  void commit() {
+    carry_over(reference, prefix);
+    committed = true;
+  }
+};
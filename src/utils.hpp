@@ -3,18 +3,37 @@
 #define _GNU_SOURCE
 #endif
 
+#include <atomic>
 #include <chrono>
 #include <curl/curl.h>
 #include <fcntl.h>
 #include <filesystem>
+#include <fnmatch.h>
 #include <fstream>
+#include <future>
+#include <map>
+#include <optional>
 #include <rpcws.hpp>
 #include <spawn.h>
+#include <sstream>
+#include <string_view>
+#include <strings.h>
 #include <sys/mman.h>
-#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <thread>
+#include <unordered_set>
 
+#include "bundle.hpp"
+#include "cache.hpp"
 #include "decompress.hpp"
+#include "hash.hpp"
+#include "pool.hpp"
+#include "procstat.hpp"
+#include "spool.hpp"
+#include "tarstream.hpp"
 
 enum struct ProcessStatus {
   Waiting,
@@ -82,7 +101,273 @@ enum class components {
   nsgod,
 };
 
-void update_progress();
+struct install_options {
+  bool stream           = true;
+  size_t buffer_size    = CHUNK * 4;
+  size_t jobs           = 3;
+  size_t segments       = 4;
+  size_t writers        = 4;
+  bool cache            = true;
+  std::string cache_dir = ".stone/cache";
+  // pinned digests as name=hex, and a sha256sum style file or url listing them
+  std::vector<std::string> sha256;
+  std::string checksums;
+  // resolved from the two above, keyed by component name
+  std::map<std::string, std::string> expected;
+  // install from a bundle, archive or mirror directory instead of the network
+  std::string from;
+  // base url serving every component under its name, instead of the registry
+  std::string mirror;
+  // installed versions of core and game kept side by side, including the current one
+  size_t keep_versions = 2;
+};
+
+inline install_options &install_settings() {
+  static install_options val;
+  return val;
+}
+
+// only available in streaming mode, set up by the install command
+inline std::unique_ptr<download_cache> &install_cache() {
+  static std::unique_ptr<download_cache> val;
+  return val;
+}
+
+// what --from provides, keyed by component name
+inline std::map<std::string, local_artifact> &local_artifacts() {
+  static std::map<std::string, local_artifact> val;
+  return val;
+}
+
+inline std::optional<std::string_view> header_value(std::string_view line, std::string_view key) {
+  if (line.size() <= key.size() || strncasecmp(line.data(), key.data(), key.size()) != 0 || line[key.size()] != ':') return std::nullopt;
+  line.remove_prefix(key.size() + 1);
+  while (!line.empty() && (line.front() == ' ' || line.front() == '\t')) line.remove_prefix(1);
+  while (!line.empty() && (line.back() == '\r' || line.back() == '\n' || line.back() == ' ')) line.remove_suffix(1);
+  return line;
+}
+
+// registries put the content digest into the blob url, e.g. .../blobs/sha256:<hex>
+inline std::string url_digest(char const *url) {
+  if (!url) return {};
+  std::string_view view{ url };
+  auto pos = view.rfind("sha256:");
+  if (pos == std::string_view::npos || view.size() < pos + 7 + 64) return {};
+  auto hex = view.substr(pos + 7, 64);
+  for (char ch : hex)
+    if (!isxdigit(ch)) return {};
+  return std::string{ hex };
+}
+
+inline bool is_sha256(std::string const &hex) { return hex.size() == 64 && std::all_of(hex.begin(), hex.end(), [](char ch) { return isxdigit(ch); }); }
+
+inline std::string fetch_text(char const *url) {
+  std::string ret;
+  CURL *eh = curl_easy_init();
+  curl_easy_setopt(eh, CURLOPT_URL, url);
+  curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(eh, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(eh, CURLOPT_CONNECTTIMEOUT_MS, 10000L);
+  curl_easy_setopt(eh, CURLOPT_WRITEDATA, &ret);
+  curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, +[](char *data, size_t n, size_t l, void *userp) {
+    ((std::string *)userp)->append(data, n * l);
+    return n * l;
+  });
+  auto code = curl_easy_perform(eh);
+  curl_easy_cleanup(eh);
+  if (code != CURLE_OK) throw std::runtime_error(std::string("Failed to download checksums (") + url + "): " + curl_easy_strerror(code));
+  return ret;
+}
+
+// Fills install_settings().expected. Lines of the checksums file are matched to components by the file
+// name up to its first dot, so "<hex>  core.tar.zst" pins core; --sha256 takes precedence over the file.
+inline void load_expected_digests() {
+  auto &opts = install_settings();
+  if (!opts.checksums.empty()) {
+    std::string text;
+    if (opts.checksums.rfind("http://", 0) == 0 || opts.checksums.rfind("https://", 0) == 0) {
+      text = fetch_text(opts.checksums.c_str());
+    } else {
+      std::ifstream ifs{ opts.checksums };
+      if (!ifs) throw std::runtime_error("Failed to read checksums: " + opts.checksums);
+      text.assign(std::istreambuf_iterator<char>{ ifs }, {});
+    }
+    std::istringstream iss{ text };
+    std::string line;
+    while (std::getline(iss, line)) {
+      std::istringstream fields{ line };
+      std::string hex, file;
+      if (!(fields >> hex >> file) || !is_sha256(hex)) continue;
+      // sha256sum marks binary mode with a leading asterisk
+      if (file[0] == '*') file.erase(0, 1);
+      auto name = std::filesystem::path(file).filename().string();
+      name.erase(std::min(name.find('.'), name.size()));
+      opts.expected[name] = hex;
+    }
+  }
+  for (auto &pin : opts.sha256) {
+    auto eq = pin.find('=');
+    if (eq == std::string::npos || !is_sha256(pin.substr(eq + 1))) throw std::runtime_error("Invalid --sha256 value, expected name=hex: " + pin);
+    opts.expected[pin.substr(0, eq)] = pin.substr(eq + 1);
+  }
+  for (auto &[name, hex] : opts.expected) std::transform(hex.begin(), hex.end(), hex.begin(), ::tolower);
+}
+
+// whether a process runs chrooted into dir or has it bind-mounted, as services do with core and game
+inline bool version_in_use(std::filesystem::path const &dir) {
+  using namespace std::filesystem;
+  std::error_code ec;
+  auto target = canonical(dir, ec);
+  if (ec) return false;
+  auto needle = "/" + target.parent_path().filename().string() + "/" + target.filename().string() + " ";
+  for (auto &item : directory_iterator("/proc", ec)) {
+    auto pid = item.path().filename().string();
+    if (!isdigit(pid[0])) continue;
+    if (read_symlink(item.path() / "root", ec) == target) return true;
+    std::ifstream ifs{ item.path() / "mountinfo" };
+    std::string line;
+    while (std::getline(ifs, line))
+      if (line.find(needle) != std::string::npos) return true;
+  }
+  return false;
+}
+
+// Root processes of each service, for when the daemon does not report pids: a service process runs chrooted
+// into the core with the service directory bound on /run/data, which its mountinfo records.
+inline std::map<std::string, std::vector<pid_t>> find_service_processes(std::vector<std::string> const &services) {
+  using namespace std::filesystem;
+  std::error_code ec;
+  std::map<std::string, std::vector<pid_t>> ret;
+  auto core = canonical(".stone/core", ec);
+  if (ec) return ret;
+  std::vector<std::pair<std::string, std::string>> needles;
+  for (auto &service : services) needles.emplace_back(service, " " + absolute(service).lexically_normal().string() + " /run/data ");
+  for (auto &item : directory_iterator("/proc", ec)) {
+    auto pid = item.path().filename().string();
+    if (!isdigit(pid[0]) || read_symlink(item.path() / "root", ec) != core) continue;
+    std::ifstream ifs{ item.path() / "mountinfo" };
+    std::string line;
+    while (std::getline(ifs, line))
+      for (auto &[service, needle] : needles)
+        if (line.find(needle) != std::string::npos) ret[service].push_back(std::stoi(pid));
+  }
+  return ret;
+}
+
+// Status and resource usage of every service, fed with status replies and started events and sampled on demand.
+// Walking /proc is the expensive part, so process trees are only rebuilt on status changes and every few samples.
+class service_monitor {
+public:
+  struct service {
+    std::string status;
+    pid_t pid = 0;
+    process_group group;
+    proc_usage usage;
+    double cpu = 0, io_rate = 0;
+    // starts seen since the monitor was created
+    unsigned restarts = 0;
+  };
+
+private:
+  std::map<std::string, service> list;
+  bool rescan = true;
+  unsigned samples = 0;
+  std::chrono::steady_clock::time_point last;
+  std::chrono::steady_clock::duration cost{};
+
+  void rescan_trees() {
+    auto children = process_children();
+    std::vector<std::string> unknown;
+    for (auto &[name, item] : list)
+      if (item.status == "running" && !item.pid) unknown.push_back(name);
+    auto found = find_service_processes(unknown);
+    for (auto &[name, item] : list) {
+      std::vector<pid_t> pids;
+      std::unordered_set<pid_t> seen;
+      if (item.status == "running")
+        for (auto root : item.pid ? std::vector<pid_t>{ item.pid } : found[name])
+          for (auto pid : process_tree(root, children))
+            if (seen.insert(pid).second) pids.push_back(pid);
+      item.group.assign(pids);
+    }
+  }
+
+public:
+  std::map<std::string, service> const &services() const { return list; }
+  std::chrono::steady_clock::duration sample_cost() const { return cost; }
+
+  void apply_status(nlohmann::json const &ret) {
+    for (auto [k, v] : ret.items()) {
+      auto &item  = list[k];
+      item.status = v["status"];
+      item.pid    = v.value("pid", 0);
+    }
+    rescan = true;
+  }
+
+  void started(std::string const &name) { list[name].restarts++; }
+
+  void sample() {
+    using namespace std::chrono;
+    static double const hz = sysconf(_SC_CLK_TCK);
+    auto now               = steady_clock::now();
+    if (std::exchange(rescan, false) || ++samples % 5 == 0) rescan_trees();
+    double elapsed = duration<double>(now - last).count();
+    last           = now;
+    for (auto &[name, item] : list) {
+      auto usage = item.group.sample();
+      // processes leaving the tree take their counters with them, never report a negative rate
+      item.cpu     = usage.cpu_ticks > item.usage.cpu_ticks ? (usage.cpu_ticks - item.usage.cpu_ticks) / hz / elapsed * 100 : 0;
+      item.io_rate = usage.io_bytes > item.usage.io_bytes ? (usage.io_bytes - item.usage.io_bytes) / elapsed : 0;
+      item.usage   = usage;
+    }
+    cost = steady_clock::now() - now;
+  }
+};
+
+// download -> decompress -> untar, fed with the downloaded bytes in arrival order
+struct stream_pipeline {
+  decompressor inflater;
+  tar_stream tar;
+
+  stream_pipeline(std::filesystem::path prefix, manifest previous, size_t buffer_size, size_t writers, std::filesystem::path reference)
+      : inflater(buffer_size)
+      , tar(std::move(prefix), std::move(previous), writers, std::move(reference)) {}
+
+  void push(char const *data, size_t size) {
+    inflater.push(data, size, [&](char const *buf, size_t n) { tar.push(buf, n); });
+  }
+
+  // the extracted tree still has to be committed
+  void finish() {
+    if (!inflater.finished()) throw std::runtime_error("Compressed file is truncated");
+    tar.finish();
+  }
+};
+
+// attached to every easy handle through CURLOPT_PRIVATE
+struct transfer {
+  components comp;
+  enum kind_t { probe, body, range } kind;
+  size_t index;
+  // range transfers look at the status on their first write, anything but 206 means the range was ignored
+  CURL *handle = nullptr;
+  bool checked = false;
+  bool ignored = false;
+  // request headers of this transfer, freed once it is done
+  curl_slist *headers = nullptr;
+};
+
+enum class install_stage {
+  idle,
+  downloading,
+  inflating,
+  extracting,
+  done,
+  failed,
+};
+
+void update_progress(bool force = false);
 
 template <components C> struct components_info {
   static int memfd() {
@@ -100,13 +385,317 @@ template <components C> struct components_info {
     return val;
   }
 
+  static std::atomic<install_stage> &stage() {
+    static std::atomic<install_stage> val{ install_stage::idle };
+    return val;
+  }
+
+  // written by whoever moves the stage to failed, read by the event loop afterwards
+  static std::string &error() {
+    static std::string val;
+    return val;
+  }
+
+  static CURLcode &result() {
+    static CURLcode val = CURLE_OK;
+    return val;
+  }
+
+  static std::atomic<size_t> &entries() {
+    static std::atomic<size_t> val{ 0 };
+    return val;
+  }
+
+  static std::unique_ptr<stream_pipeline> &pipeline() {
+    static std::unique_ptr<stream_pipeline> val;
+    return val;
+  }
+
+  static std::unique_ptr<chunk_queue> &queue() {
+    static std::unique_ptr<chunk_queue> val;
+    return val;
+  }
+
+  static CURL *&handle() {
+    static CURL *val = nullptr;
+    return val;
+  }
+
+  static std::unique_ptr<range_spool> &spool() {
+    static std::unique_ptr<range_spool> val;
+    return val;
+  }
+
+  static std::vector<transfer> &range_tags() {
+    static std::vector<transfer> val;
+    return val;
+  }
+
+  // set once run_ranges stopped touching the spool and the stream, so a fallback can start over
+  static std::future<void> &ranges_drained() {
+    static std::future<void> val;
+    return val;
+  }
+
+  // the server ignored a range, the spool was aborted to download the body in one stream instead
+  static std::atomic<bool> &falling_back() {
+    static std::atomic<bool> val{ false };
+    return val;
+  }
+
+  static bool &accept_ranges() {
+    static bool val = false;
+    return val;
+  }
+
+  struct response_info {
+    std::string etag, last_modified, digest;
+  };
+
+  static response_info &response() {
+    static response_info val;
+    return val;
+  }
+
+  static std::optional<cache_entry> &cached() {
+    static std::optional<cache_entry> val;
+    return val;
+  }
+
+  // sha256 the archive has to match, empty when neither pinned nor published
+  static std::string &expected() {
+    static std::string val;
+    return val;
+  }
+
+  static std::unique_ptr<sha256> &hasher() {
+    static std::unique_ptr<sha256> val;
+    return val;
+  }
+
+  static std::unique_ptr<cache_writer> &cache_file() {
+    static std::unique_ptr<cache_writer> val;
+    return val;
+  }
+
+  static bool &unchanged() {
+    static bool val = false;
+    return val;
+  }
+
+  struct extract_stats {
+    uint64_t written, skipped;
+    size_t removed;
+  };
+
+  static extract_stats &stats() {
+    static extract_stats val{};
+    return val;
+  }
+
+  static std::atomic<bool> &paused() {
+    static std::atomic<bool> val{ false };
+    return val;
+  }
+
+  static bool &reported() {
+    static bool val = false;
+    return val;
+  }
+
+  static int &outfd() {
+    static int fd = -1;
+    return fd;
+  }
+
+  static std::filesystem::path target() { return std::filesystem::path{ ".stone" } / name(); }
+
+  // sha256 of the archive the current tree was extracted from
+  static std::filesystem::path digest_file() { return std::filesystem::path{ ".stone" } / (std::string(name()) + ".sha256"); }
+
+  static std::string installed_digest() {
+    std::ifstream ifs{ digest_file() };
+    std::string ret;
+    ifs >> ret;
+    return ret;
+  }
+
+  static std::filesystem::path manifest_file() { return std::filesystem::path{ ".stone" } / (std::string(name()) + ".manifest"); }
+
+  // core and game are installed side by side as .stone/versions/<name>-<id>, target() is a symlink to the current one
+  static std::filesystem::path versions_dir() { return std::filesystem::path{ ".stone" } / "versions"; }
+
+  // the new tree is extracted here and only becomes a version once the archive is verified
+  static std::filesystem::path staging() { return versions_dir() / (std::string(name()) + ".staging"); }
+
+  // what target() points at, or target() itself for a tree installed before versioning
+  static std::filesystem::path current_version() {
+    std::error_code ec;
+    if (is_symlink(symlink_status(target(), ec))) return canonical(target(), ec);
+    return target();
+  }
+
+  // turns the staging tree into a new version and points target() at it, the old tree stays for running services
+  static void publish(std::string const &digest) {
+    using namespace std::filesystem;
+    std::string base = std::string(name()) + "-" + (digest.empty() ? std::to_string(time(nullptr)) : digest.substr(0, 12));
+    path version     = versions_dir() / base;
+    for (int i = 1; exists(version); i++) version = versions_dir() / (base + "-" + std::to_string(i));
+    rename(staging(), version);
+    last_write_time(version, file_time_type::clock::now());
+    std::error_code ec;
+    path next = target().string() + ".next";
+    remove(next, ec);
+    create_symlink(version.lexically_relative(target().parent_path()), next);
+    if (is_directory(symlink_status(target(), ec))) {
+      // a tree from before versioning becomes the previous version, under a name that is free before anything is switched
+      std::string legacy_base = std::string(name()) + "-legacy";
+      path legacy             = versions_dir() / legacy_base;
+      for (int i = 1; exists(legacy); i++) legacy = versions_dir() / (legacy_base + "-" + std::to_string(i));
+      if (renameat2(AT_FDCWD, next.c_str(), AT_FDCWD, target().c_str(), RENAME_EXCHANGE) == 0) {
+        // the new version is live already, a failure here must not report the install as failed
+        rename(next, legacy, ec);
+      } else {
+        rename(target(), legacy);
+        rename(next, target());
+      }
+      last_write_time(legacy, file_time_type::clock::now() - std::chrono::seconds(1), ec);
+    } else {
+      // replacing a symlink by rename is atomic
+      rename(next, target());
+    }
+    prune_versions(version);
+  }
+
+  // keeps the newest versions, the current one and those still in use always
+  static void prune_versions(std::filesystem::path const &current) {
+    using namespace std::filesystem;
+    std::vector<std::pair<file_time_type, path>> found;
+    std::error_code ec;
+    auto prefix = std::string(name()) + "-";
+    for (auto &item : directory_iterator(versions_dir(), ec))
+      if (item.is_directory() && item.path().filename().string().rfind(prefix, 0) == 0 && item.path() != current)
+        found.emplace_back(last_write_time(item.path(), ec), item.path());
+    std::sort(found.begin(), found.end(), [](auto &a, auto &b) { return a.first > b.first; });
+    for (size_t i = install_settings().keep_versions ? install_settings().keep_versions - 1 : 0; i < found.size(); i++)
+      if (!version_in_use(found[i].second)) remove_all(found[i].second, ec);
+  }
+
+  static bool changed() { return stage() == install_stage::done && !unchanged(); }
+
+  static void verify(std::string const &digest) {
+    if (!expected().empty() && digest != expected()) throw std::runtime_error("Checksum mismatch: expected " + expected() + ", got " + digest);
+  }
+
+  static void prepare_stream() {
+    using namespace std::filesystem;
+    create_directory(".stone");
+    if constexpr (C == components::nsgod) {
+      outfd() = ::open((target().string() + ".tmp").c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0755);
+      if (outfd() < 0) throw std::runtime_error(std::string("Failed to open output: ") + strerror(errno));
+    } else {
+      create_directories(versions_dir());
+      pipeline() = std::make_unique<stream_pipeline>(staging(), read_manifest(manifest_file()), install_settings().buffer_size,
+                                                    install_settings().writers, current_version());
+    }
+    queue() = std::make_unique<chunk_queue>(install_settings().buffer_size * 8);
+  }
+
+  static void write_stream(char const *data, size_t len) {
+    if constexpr (C == components::nsgod) {
+      while (len) {
+        auto ret = ::write(outfd(), data, len);
+        if (ret < 0) {
+          if (errno == EINTR) continue;
+          throw std::runtime_error(std::string("Failed to write: ") + strerror(errno));
+        }
+        data += ret;
+        len -= ret;
+      }
+    } else {
+      pipeline()->push(data, len);
+      entries() = pipeline()->tar.count();
+    }
+  }
+
+  // every downloaded byte passes through here: hashed, copied into the cache and extracted in one pass
+  static void ingest(char const *data, size_t len) {
+    if (hasher()) hasher()->update(data, len);
+    if (cache_file()) cache_file()->write(data, len);
+    write_stream(data, len);
+  }
+
+  // drops everything prepare_stream set up when the archive does not need to be extracted after all
+  static void discard_stream() {
+    using namespace std::filesystem;
+    pipeline().reset();
+    if (outfd() >= 0) {
+      close(outfd());
+      outfd() = -1;
+      std::error_code ec;
+      remove(target().string() + ".tmp", ec);
+    }
+  }
+
   static size_t write_cb(char *data, size_t n, size_t l, void *userp) {
-    fwrite(data, n, l, memfile());
+    if (!install_settings().stream) {
+      hasher()->update(data, n * l);
+      fwrite(data, n, l, memfile());
+      size() += n * l;
+      return n * l;
+    }
+    // returning a short count makes curl abort the transfer with CURLE_WRITE_ERROR
+    if (stage() == install_stage::failed) return 0;
+    paused() = true;
+    if (!queue()->try_push(data, n * l)) return CURL_WRITEFUNC_PAUSE;
+    paused() = false;
+    size() += n * l;
+    return n * l;
+  }
+
+  static size_t range_write_cb(char *data, size_t n, size_t l, void *userp) {
+    auto &tag = *(transfer *)userp;
+    if (stage() == install_stage::failed) return 0;
+    // a server that ignores the range answers 200 with the whole body, stopped before any of it lands in the segment
+    if (!std::exchange(tag.checked, true)) {
+      long status = 0;
+      curl_easy_getinfo(tag.handle, CURLINFO_RESPONSE_CODE, &status);
+      tag.ignored = status != 206;
+      if (tag.ignored) return 0;
+    }
+    if (tag.ignored || !spool()->write(tag.index, data, n * l)) return 0;
+    // every range transfer runs on the event loop, like write_cb
     size() += n * l;
     return n * l;
   }
 
-  static constexpr components tag = C;
+  static size_t header_cb(char *data, size_t n, size_t l, void *userp) {
+    std::string_view line{ data, n * l };
+    // every response in a redirect chain starts with a status line
+    if (line.substr(0, 5) == "HTTP/") {
+      accept_ranges() = false;
+      response()      = {};
+    } else if (auto value = header_value(line, "accept-ranges")) {
+      accept_ranges() = value->find("bytes") != std::string_view::npos;
+    } else if (auto value = header_value(line, "etag")) {
+      response().etag = *value;
+    } else if (auto value = header_value(line, "last-modified")) {
+      response().last_modified = *value;
+    } else if (auto value = header_value(line, "docker-content-digest")) {
+      if (value->substr(0, 7) == "sha256:") response().digest = value->substr(7);
+    }
+    return n * l;
+  }
+
+  static transfer &probe_tag() {
+    static transfer val{ C, transfer::probe, 0 };
+    return val;
+  }
+
+  static transfer &body_tag() {
+    static transfer val{ C, transfer::body, 0 };
+    return val;
+  }
 
   static char const *name() {
     switch (C) {
@@ -117,6 +706,10 @@ template <components C> struct components_info {
   }
 
   static char const *url() {
+    if (!install_settings().mirror.empty()) {
+      static std::string val = install_settings().mirror + "/" + name();
+      return val.c_str();
+    }
     switch (C) {
     case components::core: return "https://hertz.services/docker/codehz/stoneserver/0";
     case components::game: return "https://hertz.services/docker/codehz/mcbe/0";
@@ -124,100 +717,531 @@ template <components C> struct components_info {
     }
   }
 
-  static bool &enabled() {
-    static bool val = false;
-    return val;
-  }
-
   static double &progress() {
     static double val = 0.0;
     return val;
   }
   static void print() {
-    if (enabled()) printf("[%-5s]⇩%5.1lf%%", name(), progress());
+    switch (stage()) {
+    case install_stage::downloading:
+      printf("[%-5s]⇩%5.1lf%%", name(), progress());
+      if (entries()) printf("(%zu files)", entries().load());
+      break;
+    case install_stage::inflating: printf("[%-5s]inflating", name()); break;
+    case install_stage::extracting: printf("[%-5s]extracting(%zu files)", name(), entries().load()); break;
+    default: break;
+    }
   }
 
   static int xferinfo(void *p, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
-    if (dltotal) progress() = ((double)dlnow / (double)dltotal * 100);
+    if (spool())
+      progress() = (double)spool()->received() / (double)spool()->total() * 100;
+    else if (dltotal)
+      progress() = ((double)dlnow / (double)dltotal * 100);
     update_progress();
     return 0;
   }
 
-  static void add_transfer(CURLM *cm) {
-    enabled() = true;
-    CURL *eh  = curl_easy_init();
-    curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, write_cb);
-    curl_easy_setopt(eh, CURLOPT_URL, url());
+  static void fail(std::string message) {
+    discard_stream();
+    cache_file().reset();
+    error() = std::move(message);
+    stage() = install_stage::failed;
+    notify();
+  }
+
+  static CURL *new_handle(transfer &tag, char const *target_url) {
+    CURL *eh = curl_easy_init();
+    curl_easy_setopt(eh, CURLOPT_URL, target_url);
     curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(eh, CURLOPT_FAILONERROR, 1L);
     curl_easy_setopt(eh, CURLOPT_PRIVATE, &tag);
     curl_easy_setopt(eh, CURLOPT_XFERINFOFUNCTION, xferinfo);
     curl_easy_setopt(eh, CURLOPT_NOPROGRESS, 0L);
     curl_easy_setopt(eh, CURLOPT_ACCEPTTIMEOUT_MS, 10000L);
     curl_easy_setopt(eh, CURLOPT_CONNECTTIMEOUT_MS, 10000L);
+    if (install_settings().stream) curl_easy_setopt(eh, CURLOPT_BUFFERSIZE, (long)install_settings().buffer_size);
+    return eh;
+  }
+
+  static void add_transfer(CURLM *cm, worker_pool &pool) {
+    auto pinned = install_settings().expected.find(name());
+    if (pinned != install_settings().expected.end()) expected() = pinned->second;
+    if (!install_settings().from.empty()) return add_local(pool);
+    if (install_settings().stream) try {
+        prepare_stream();
+      } catch (std::exception &ex) {
+        fprintf(stderr, "[%-5s]%s\n", name(), ex.what());
+        return;
+      }
+    stage() = install_stage::downloading;
+    if (install_settings().stream) {
+      // the probe tells whether the cached copy is still valid and whether the body can be fetched in parallel ranges
+      CURL *eh = new_handle(probe_tag(), url());
+      curl_easy_setopt(eh, CURLOPT_NOBODY, 1L);
+      curl_easy_setopt(eh, CURLOPT_HEADERFUNCTION, header_cb);
+      if (install_cache() && (cached() = install_cache()->lookup(url()))) {
+        auto &headers = probe_tag().headers;
+        if (!cached()->etag.empty()) headers = curl_slist_append(headers, ("If-None-Match: " + cached()->etag).c_str());
+        if (!cached()->last_modified.empty()) headers = curl_slist_append(headers, ("If-Modified-Since: " + cached()->last_modified).c_str());
+        curl_easy_setopt(eh, CURLOPT_HTTPHEADER, headers);
+      }
+      curl_multi_add_handle(cm, eh);
+    } else {
+      add_body(cm, pool, url());
+    }
+  }
+
+  static void add_local(worker_pool &pool) {
+    auto it = local_artifacts().find(name());
+    if (it == local_artifacts().end()) return fail("Not found in " + install_settings().from);
+    try {
+      prepare_stream();
+    } catch (std::exception &ex) {
+      fprintf(stderr, "[%-5s]%s\n", name(), ex.what());
+      return;
+    }
+    if (expected().empty()) expected() = it->second.sha256;
+    stage() = install_stage::downloading;
+    pool.submit([artifact = it->second] { run_local(artifact); });
+  }
+
+  // hashing and caching are set up on the event loop, before any worker touches the data
+  static void begin_ingest() {
+    std::error_code ec;
+    std::filesystem::remove(digest_file(), ec);
+    hasher() = std::make_unique<sha256>();
+    if (install_cache()) try {
+        cache_file() = std::make_unique<cache_writer>(install_cache()->path());
+      } catch (std::exception &ex) {
+        fprintf(stderr, "\r\033[2K[%-5s]%s, continuing without cache\n", name(), ex.what());
+      }
+  }
+
+  static void add_body(CURLM *cm, worker_pool &pool, char const *target_url) {
+    begin_ingest();
+    CURL *eh = new_handle(body_tag(), target_url);
+    curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, write_cb);
     curl_multi_add_handle(cm, eh);
+    handle() = eh;
+    if (install_settings().stream) pool.submit(run_stream);
   }
 
-  static void extract(CURLcode code) {
-    using namespace std::filesystem;
-    fflush(memfile());
-    enabled() = false;
+  static void add_ranges(CURLM *cm, worker_pool &pool, char const *target_url, uint64_t length, size_t count) {
+    begin_ingest();
+    spool()      = std::make_unique<range_spool>(".stone", length, count, install_settings().buffer_size);
+    auto &tags   = range_tags();
+    tags.clear();
+    for (size_t i = 0; i < count; i++) tags.push_back({ C, transfer::range, i });
+    for (auto &tag : tags) {
+      auto [begin, end] = spool()->range(tag.index);
+      auto range        = std::to_string(begin) + "-" + std::to_string(end - 1);
+      CURL *eh          = new_handle(tag, target_url);
+      tag.handle        = eh;
+      curl_easy_setopt(eh, CURLOPT_RANGE, range.c_str());
+      curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, range_write_cb);
+      curl_easy_setopt(eh, CURLOPT_WRITEDATA, &tag);
+      curl_multi_add_handle(cm, eh);
+    }
+    auto drained     = std::make_shared<std::promise<void>>();
+    ranges_drained() = drained->get_future();
+    pool.submit([drained] {
+      run_ranges();
+      drained->set_value();
+    });
+  }
+
+  // a server that answers a range with the whole body is used like one without range support: the other ranges are
+  // cancelled and everything ingested so far is dropped before the body is requested again in one stream
+  static void fall_back_to_body(CURLM *cm, worker_pool &pool) {
+    if (stage() == install_stage::failed) return;
+    falling_back() = true;
+    for (auto &other : range_tags())
+      if (auto eh = std::exchange(other.handle, nullptr)) {
+        curl_multi_remove_handle(cm, eh);
+        curl_easy_cleanup(eh);
+      }
+    spool()->abort("range request ignored");
+    ranges_drained().wait();
+    spool().reset();
+    hasher().reset();
+    cache_file().reset();
+    discard_stream();
+    size()         = 0;
+    entries()      = 0;
+    progress()     = 0;
+    falling_back() = false;
+    fprintf(stderr, "\r\033[2K[%-5s]Server ignored the range request, downloading in one stream\n", name());
+    try {
+      prepare_stream();
+    } catch (std::exception &ex) {
+      return fail(ex.what());
+    }
+    add_body(cm, pool, url());
+  }
+
+  // called on the event loop when curl reports a transfer of this component finished
+  static void transfer_done(transfer const &tag, CURL *eh, CURLcode code, CURLM *cm, worker_pool &pool) {
+    switch (tag.kind) {
+    case transfer::probe: {
+      curl_slist_free_all(std::exchange(probe_tag().headers, nullptr));
+      curl_off_t length = -1;
+      long status       = 0;
+      char *effective   = nullptr;
+      curl_easy_getinfo(eh, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+      curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &status);
+      curl_easy_getinfo(eh, CURLINFO_EFFECTIVE_URL, &effective);
+      // the digest published by the registry is what the body is checked against unless one was pinned
+      if (code == CURLE_OK && expected().empty()) expected() = response().digest.empty() ? url_digest(effective) : response().digest;
+      std::string hit;
+      if (code == CURLE_OK && status == 304 && cached())
+        hit = cached()->sha256;
+      else if (code == CURLE_OK && install_cache() && install_cache()->has(expected()))
+        hit = expected();
+      // a cached copy that is not the expected archive is downloaded again
+      if (!expected().empty() && hit != expected()) hit.clear();
+      if (!hit.empty()) {
+        pool.submit([hit] { run_cached(hit); });
+        break;
+      }
+      // ranges below this size are not worth an extra connection
+      constexpr curl_off_t min_segment = 4 << 20;
+      size_t count                     = std::min<curl_off_t>(install_settings().segments, length / min_segment);
+      if (code == CURLE_OK && status == 200 && accept_ranges() && count > 1 && effective)
+        add_ranges(cm, pool, effective, length, count);
+      else
+        add_body(cm, pool, url());
+      break;
+    }
+    case transfer::body: download_done(code, pool); break;
+    case transfer::range:
+      range_tags()[tag.index].handle = nullptr;
+      if (tag.ignored)
+        fall_back_to_body(cm, pool);
+      else if (code != CURLE_OK)
+        spool()->abort(std::string("Failed to download (") + url() + "): " + curl_easy_strerror(code));
+      else if (!spool()->complete(tag.index))
+        spool()->abort(std::string("Failed to download (") + url() + "): server did not honor the requested range");
+      break;
+    }
+  }
 
-    if (code != CURLE_OK) {
-      printf("\n[%-5s]Failed to download (%s)\n", name(), url());
+  static void download_done(CURLcode code, worker_pool &pool) {
+    handle() = nullptr;
+    paused() = false;
+    result() = code;
+    if (install_settings().stream) {
+      // the worker picks up the result once it drains the queue
+      queue()->close();
+    } else if (code != CURLE_OK) {
+      fail(std::string("Failed to download (") + url() + ")");
+    } else {
+      fflush(memfile());
+      stage() = install_stage::inflating;
+      pool.submit(run_buffered);
+    }
+  }
+
+  // called on the event loop after every wakeup: resumes throttled transfers and reports finished components
+  static void poll() {
+    if (paused() && handle() && queue()->has_room()) {
+      paused() = false;
+      curl_easy_pause(handle(), CURLPAUSE_CONT);
+    }
+    auto current = stage().load();
+    if (reported() || (current != install_stage::done && current != install_stage::failed)) return;
+    reported() = true;
+    if (current == install_stage::done) {
+      printf("\r\033[2K[%-5s]%s\n", name(), unchanged() ? "Up to date." : "Done.");
+      if (stats().written || stats().skipped)
+        printf("[%-5s]%.1f MB written, %.1f MB unchanged, %zu removed\n", name(), (double)stats().written / 1048576, (double)stats().skipped / 1048576,
+               stats().removed);
+    } else
+      printf("\r\033[2K[%-5s]%s\n", name(), error().c_str());
+  }
+
+  static void run_stream() {
+    std::vector<char> chunk;
+    try {
+      while (queue()->pop(chunk)) {
+        ingest(chunk.data(), chunk.size());
+        if (paused() && queue()->has_room()) notify();
+      }
+    } catch (std::exception &ex) {
+      fail(std::string("Failed to extract: ") + ex.what());
       return;
     }
+    if (result() != CURLE_OK) return fail(std::string("Failed to download (") + url() + "): " + curl_easy_strerror(result()));
+    finish_stream();
+  }
+
+  // ranges land in the spool at their final offsets, the extractor still consumes them strictly in order
+  static void run_ranges() {
+    try {
+      for (size_t i = 0; i < spool()->count(); i++)
+        if (!spool()->drain(i, [](char const *data, size_t size) { ingest(data, size); })) {
+          if (!falling_back()) fail(spool()->error());
+          return;
+        }
+    } catch (std::exception &ex) {
+      if (!falling_back()) fail(std::string("Failed to extract: ") + ex.what());
+      return;
+    }
+    spool()->discard();
+    finish_stream();
+  }
+
+  // the archive is already in the cache: nothing is downloaded, and nothing is extracted if it is what we installed last time
+  static void run_cached(std::string const &digest) {
+    if (installed_digest() == digest) {
+      discard_stream();
+      unchanged() = true;
+      stage()     = install_stage::done;
+      notify();
+      return;
+    }
+    std::error_code ec;
+    std::filesystem::remove(digest_file(), ec);
+    int fd = ::open(install_cache()->blob(digest).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return fail(std::string("Failed to open cached archive: ") + strerror(errno));
+    guard fd_guard{ [&] { close(fd); } };
+    std::vector<char> buffer(install_settings().buffer_size);
+    try {
+      ssize_t ret;
+      while ((ret = read(fd, buffer.data(), buffer.size())) > 0) write_stream(buffer.data(), ret);
+      if (ret < 0) throw std::runtime_error(strerror(errno));
+    } catch (std::exception &ex) {
+      fail(std::string("Failed to extract: ") + ex.what());
+      return;
+    }
+    finish_stream(digest);
+  }
 
+  // the archive is mapped and fed to the extractor straight from the page cache, hashed on the way like a download
+  static void run_local(local_artifact const &artifact) {
+    if (!expected().empty() && installed_digest() == expected()) {
+      discard_stream();
+      unchanged() = true;
+      stage()     = install_stage::done;
+      notify();
+      return;
+    }
+    std::error_code ec;
+    std::filesystem::remove(digest_file(), ec);
+    hasher() = std::make_unique<sha256>();
+    try {
+      mapped_file map{ artifact.file };
+      if (artifact.offset + artifact.size > map.size()) throw std::runtime_error(artifact.file.string() + " is truncated");
+      // slices keep the progress moving, they are not copied
+      constexpr uint64_t slice = 4 << 20;
+      for (uint64_t pos = 0; pos < artifact.size; pos += slice) {
+        auto len = std::min(slice, artifact.size - pos);
+        ingest(map.data() + artifact.offset + pos, len);
+        progress() = (double)(pos + len) / (double)artifact.size * 100;
+        notify();
+      }
+    } catch (std::exception &ex) {
+      fail(std::string("Failed to extract: ") + ex.what());
+      return;
+    }
+    finish_stream();
+  }
+
+  static void finish_stream(std::string digest = {}) {
+    using namespace std::filesystem;
+    if (hasher()) {
+      digest = hasher()->hex();
+      hasher().reset();
+    }
+    stage() = install_stage::extracting;
+    notify();
+    try {
+      if constexpr (C == components::nsgod) {
+        verify(digest);
+        close(outfd());
+        outfd() = -1;
+        rename(target().string() + ".tmp", target());
+      } else {
+        pipeline()->finish();
+        // the installed tree is untouched until here
+        verify(digest);
+        auto &tar = pipeline()->tar;
+        tar.commit();
+        publish(digest);
+        write_manifest(manifest_file(), tar.result());
+        stats() = { tar.bytes_written(), tar.bytes_skipped(), tar.files_removed() };
+        pipeline().reset();
+      }
+      if (cache_file()) {
+        cache_file()->commit(digest);
+        cache_file().reset();
+        install_cache()->store(url(), { response().etag, response().last_modified, digest, size() });
+      }
+    } catch (std::exception &ex) {
+      fail(std::string("Failed to extract: ") + ex.what());
+      return;
+    }
+    if (!digest.empty()) std::ofstream{ digest_file() } << digest << std::endl;
+    complete();
+  }
+
+  static void run_buffered() {
+    using namespace std::filesystem;
+    auto digest = hasher()->hex();
+    hasher().reset();
+    try {
+      verify(digest);
+    } catch (std::exception &ex) {
+      fail(ex.what());
+      return;
+    }
+    create_directory(".stone");
     if constexpr (C == components::nsgod) {
-      printf("\r\033[2K[%-5s]Writing...(%4.1f MB)\n", name(), (double)size() / 1048576);
-      path base = ".stone";
-      create_directory(base);
-      path target{ base / name() };
-      int tfd   = ::open(target.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0755);
-      off_t off = 0;
-      sendfile(tfd, memfd(), &off, size());
-      close(tfd);
-      printf("[%-5s]Done.\n", name());
+      auto temp = target().string() + ".tmp";
+      int tfd   = ::open(temp.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0755);
+      if (tfd < 0) return fail(std::string("Failed to open output: ") + strerror(errno));
+      try {
+        copy_fd_range(memfd(), 0, tfd, size());
+        close(tfd);
+        rename(temp, target());
+      } catch (std::exception &ex) {
+        close(tfd);
+        fail(std::string("Failed to write: ") + ex.what());
+        return;
+      }
     } else {
-      printf("\r\033[2K[%-5s]Extracting...\n", name());
-      path base = path{ ".stone" } / name();
-      create_directories(base);
       int temp = memfd_create(name(), O_RDWR);
       guard temp_guard{ [&] { close(temp); } };
       lseek(memfd(), 0, SEEK_SET);
       try {
-        degz([&](auto buffer, auto size) { return read(memfd(), buffer, size); }, [&](auto buffer, auto size) { return write(temp, buffer, size); });
+        decompress([&](auto buffer, auto size) { return read(memfd(), buffer, size); }, [&](auto buffer, auto size) { write_fd(temp, buffer, size); },
+                   install_settings().buffer_size);
       } catch (std::exception &ex) {
-        fprintf(stderr, "[%-5s]Failed to inflate: %s", name(), ex.what());
+        fail(std::string("Failed to inflate: ") + ex.what());
         return;
       }
 
-      lseek(temp, 0, SEEK_SET);
+      stage() = install_stage::extracting;
+      notify();
       try {
-        untar(temp, base.string().data(), name());
+        create_directories(versions_dir());
+        tar_stream tar{ staging(), read_manifest(manifest_file()), install_settings().writers, current_version() };
+        tar.extract_fd(temp);
+        tar.finish();
+        tar.commit();
+        publish(digest);
+        write_manifest(manifest_file(), tar.result());
+        stats() = { tar.bytes_written(), tar.bytes_skipped(), tar.files_removed() };
       } catch (std::exception &ex) {
-        fprintf(stderr, "[%-5s]Failed to extract: %s", name(), ex.what());
+        fail(std::string("Failed to extract: ") + ex.what());
         return;
       }
-      if constexpr (C == components::core) {
-        create_directory(base / "proc");
-        create_directory(base / "tmp");
-        create_directory(base / "dev");
+    }
+    std::ofstream{ digest_file() } << digest << std::endl;
+    complete();
+  }
+
+  static void complete() {
+    using namespace std::filesystem;
+    if constexpr (C == components::core) {
+      path base = target();
+      auto data     = read_manifest(manifest_file());
+      bool recorded = !data.empty();
+      for (auto mount : { "proc", "tmp", "dev" }) {
+        create_directory(base / mount);
+        data.try_emplace(mount, untracked_entry());
       }
-      printf("\n[%-5s]Done.\n", name());
+      // installs from before manifests were recorded have nothing to add to
+      if (recorded) write_manifest(manifest_file(), data);
     }
+    stage() = install_stage::done;
+    notify();
   }
 };
 
-void update_progress() {
-  printf("\r");
+// progress is refreshed from every curl callback, so redraws are capped at 10 per second
+void update_progress(bool force) {
+  using namespace std::chrono;
+  static steady_clock::time_point last;
+  auto now = steady_clock::now();
+  if (!force && now - last < 100ms) return;
+  last = now;
+  printf("\r\033[2K");
   components_info<components::core>::print();
   components_info<components::game>::print();
   components_info<components::nsgod>::print();
   fflush(stdout);
 }
 
+// rpc latency in cumulative buckets, the shape the prometheus text format expects; bounds in seconds
+struct latency_histogram {
+  static constexpr double bounds[] = { 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5 };
+  uint64_t buckets[std::size(bounds)]{}, count = 0;
+  double sum = 0;
+
+  void record(double seconds) {
+    for (size_t i = 0; i < std::size(bounds); i++)
+      if (seconds <= bounds[i]) buckets[i]++;
+    count++;
+    sum += seconds;
+  }
+};
+
+// collected for --timing
+struct command_timing {
+  bool enabled = false;
+  bool spawned = false;
+  // commands that never talk to the daemon leave daemon out of the report
+  bool reached = false;
+  std::chrono::steady_clock::time_point began;
+  std::chrono::steady_clock::duration daemon{}, rpc_total{}, rpc_max{};
+  size_t rpc_calls = 0;
+  std::map<std::string, latency_histogram> rpc_latency;
+
+  void record_rpc(std::string const &method, std::chrono::steady_clock::duration elapsed) {
+    rpc_calls++;
+    rpc_total += elapsed;
+    rpc_max = std::max(rpc_max, elapsed);
+    rpc_latency[method].record(std::chrono::duration<double>(elapsed).count());
+  }
+};
+
+inline command_timing &timing() {
+  static command_timing val;
+  return val;
+}
+
+inline void print_timing() {
+  using namespace std::chrono;
+  auto ms    = [](auto value) { return duration<double, std::milli>(value).count(); };
+  auto &info = timing();
+  fprintf(stderr, "timing: ");
+  if (info.reached) fprintf(stderr, "daemon %.2fms%s, ", ms(info.daemon), info.spawned ? " (spawned)" : "");
+  fprintf(stderr, "rpc %zu call(s) avg %.2fms max %.2fms, total %.2fms\n", info.rpc_calls, info.rpc_calls ? ms(info.rpc_total) / info.rpc_calls : 0.0,
+          ms(info.rpc_max), ms(steady_clock::now() - info.began));
+}
+
+// a listening daemon accepts the connection, a stale socket file left by a dead one refuses it
+inline bool daemon_reachable(char const *socket_path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return false;
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path, sizeof addr.sun_path - 1);
+  bool ret = connect(fd, (sockaddr *)&addr, sizeof addr) == 0;
+  close(fd);
+  return ret;
+}
+
 void start_nsgod(size_t) {
-  using namespace std::filesystem;
+  using namespace std::chrono;
+  auto began = steady_clock::now();
+  guard record{ [&] {
+    timing().daemon  = steady_clock::now() - began;
+    timing().reached = true;
+  } };
+  if (daemon_reachable(".stone/nsgod.socket")) return;
+  timing().spawned = true;
   pid_t pid;
   char const *const xarg[] = { "nsgod for stoneserver", nullptr };
   char const *const xenv[] = {
@@ -225,12 +1249,68 @@ void start_nsgod(size_t) {
     "NSGOD_LOCK=.stone/nsgod.lock",
     nullptr,
   };
-  posix_spawn(&pid, ".stone/nsgod", nullptr, nullptr, (char *const *)xarg, (char *const *)xenv);
-  wait(nullptr);
-  if (!exists(".stone/nsgod.socket")) {
-    std::cerr << "Failed to start daemon" << std::endl;
+  if (int err = posix_spawn(&pid, ".stone/nsgod", nullptr, nullptr, (char *const *)xarg, (char *const *)xenv)) {
+    std::cerr << "Failed to start daemon: " << strerror(err) << std::endl;
     exit(EXIT_FAILURE);
   }
+  waitpid(pid, nullptr, 0);
+  // the daemon binds its socket shortly after detaching
+  auto delay    = 2ms;
+  auto deadline = steady_clock::now() + 5s;
+  while (!daemon_reachable(".stone/nsgod.socket")) {
+    if (steady_clock::now() >= deadline) {
+      std::cerr << "Failed to start daemon" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::this_thread::sleep_for(delay);
+    delay = std::min<milliseconds>(delay * 2, 200ms);
+  }
+}
+
+// timerfd for the rpc event loop, fires once after interval or every interval when repeating
+// a zero interval disarms the timer
+inline void arm_timer(int fd, std::chrono::nanoseconds interval, bool repeat = false) {
+  itimerspec spec{};
+  spec.it_value.tv_sec  = interval.count() / 1000000000;
+  spec.it_value.tv_nsec = interval.count() % 1000000000;
+  if (repeat) spec.it_interval = spec.it_value;
+  timerfd_settime(fd, 0, &spec, nullptr);
+}
+
+inline int make_timer(std::chrono::nanoseconds interval, bool repeat = false) {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) throw std::runtime_error(std::string("Failed to create timer: ") + strerror(errno));
+  arm_timer(fd, interval, repeat);
+  return fd;
+}
+
+// accepts the letters print_level shows, the level names or the numbers the api sends
+inline int parse_log_level(std::string const &name) {
+  static char const *const names[] = { "trace", "debug", "info", "warn", "error" };
+  for (int i = 0; i < 5; i++)
+    if (strcasecmp(name.c_str(), names[i]) == 0 || (name.size() == 1 && toupper(name[0]) == toupper(names[i][0])) || name == std::to_string(i)) return i;
+  if (strcasecmp(name.c_str(), "warning") == 0) return 3;
+  throw std::runtime_error("Unknown log level: " + name);
+}
+
+// The log api has no subscription parameters, so entries are filtered as soon as they arrive, before any formatting
+struct log_filter {
+  int min_level = 0;
+  // globs, an entry passes when its tag matches any of them
+  std::vector<std::string> tags;
+
+  bool accepts(int level, std::string const &tag) const {
+    if (level < min_level) return false;
+    if (tags.empty()) return true;
+    for (auto &pattern : tags)
+      if (fnmatch(pattern.c_str(), tag.c_str(), 0) == 0) return true;
+    return false;
+  }
+};
+
+inline log_filter &log_settings() {
+  static log_filter val;
+  return val;
 }
 
 std::string_view print_level(int level) {
@@ -0,0 +1,171 @@
+#pragma once
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <stdexcept>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+inline void write_fd(int fd, char const *data, size_t size) {
+  while (size) {
+    auto ret = ::write(fd, data, size);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      throw std::runtime_error(std::string("write failed: ") + strerror(errno));
+    }
+    data += ret;
+    size -= ret;
+  }
+}
+
+// copies size bytes of in starting at offset to the current position of out, in kernel when the filesystem allows it
+inline void copy_fd_range(int in, uint64_t offset, int out, uint64_t size) {
+  loff_t off = offset;
+  while (size) {
+    auto ret = copy_file_range(in, &off, out, nullptr, size, 0);
+    if (ret > 0) {
+      size -= ret;
+      continue;
+    }
+    if (ret == 0) throw std::runtime_error("copy failed: source is truncated");
+    if (errno == EINTR) continue;
+    if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP && errno != EBADF) throw std::runtime_error(std::string("copy failed: ") + strerror(errno));
+    char buffer[65536];
+    while (size) {
+      auto got = pread(in, buffer, std::min<uint64_t>(size, sizeof buffer), off);
+      if (got < 0 && errno == EINTR) continue;
+      if (got <= 0) throw std::runtime_error(std::string("copy failed: ") + (got ? strerror(errno) : "source is truncated"));
+      write_fd(out, buffer, got);
+      off += got;
+      size -= got;
+    }
+  }
+}
+
+// Writes file bodies on behalf of a single parser thread. Every file is pinned to one lane so its chunks
+// stay in order, and the bytes queued across all lanes are bounded; the parser blocks when it gets ahead.
+class file_writers {
+public:
+  struct job {
+    int fd;
+    std::vector<char> data;
+    // alternatively copy from a seekable source without going through userspace
+    int source             = -1;
+    uint64_t source_offset = 0, source_size = 0;
+    // set on the first job of a file
+    uint64_t preallocate = 0;
+    // set on the last job of a file
+    bool last    = false;
+    mode_t mode  = 0;
+    time_t mtime = 0;
+  };
+
+private:
+  struct lane {
+    std::deque<job> jobs;
+    std::condition_variable cv;
+    std::thread thread;
+  };
+
+  std::vector<lane> lanes;
+  std::mutex mtx;
+  std::condition_variable space_cv, idle_cv;
+  size_t queued = 0, limit, busy = 0, next = 0;
+  bool stopping = false;
+  std::string error;
+
+  static void run_job(job &item) {
+    if (item.preallocate) fallocate(item.fd, 0, 0, item.preallocate);
+    if (!item.data.empty()) write_fd(item.fd, item.data.data(), item.data.size());
+    if (item.source >= 0) copy_fd_range(item.source, item.source_offset, item.fd, item.source_size);
+    if (item.last) {
+      struct timespec times[2] = { { 0, UTIME_OMIT }, { item.mtime, 0 } };
+      fchmod(item.fd, item.mode);
+      futimens(item.fd, times);
+      ::close(item.fd);
+    }
+  }
+
+  void run(lane &self) {
+    std::unique_lock lock{ mtx };
+    while (true) {
+      self.cv.wait(lock, [&] { return stopping || !self.jobs.empty(); });
+      if (self.jobs.empty()) return;
+      auto item = std::move(self.jobs.front());
+      self.jobs.pop_front();
+      busy++;
+      bool skip = !error.empty();
+      lock.unlock();
+      bool closed = false;
+      try {
+        if (!skip) {
+          run_job(item);
+          closed = item.last;
+        }
+      } catch (std::exception &ex) {
+        std::lock_guard elock{ mtx };
+        if (error.empty()) error = ex.what();
+      }
+      // the descriptor belongs to the lane once its last job is queued, even when something failed
+      if (item.last && !closed) ::close(item.fd);
+      lock.lock();
+      busy--;
+      queued -= item.data.size();
+      space_cv.notify_all();
+      idle_cv.notify_all();
+    }
+  }
+
+  void check() {
+    if (!error.empty()) throw std::runtime_error("tar extract failed: " + error);
+  }
+
+public:
+  file_writers(size_t count, size_t limit)
+      : lanes(count)
+      , limit(limit) {
+    for (auto &item : lanes) item.thread = std::thread([this, &item] { run(item); });
+  }
+  file_writers(file_writers const &) = delete;
+  ~file_writers() {
+    {
+      std::lock_guard lock{ mtx };
+      stopping = true;
+    }
+    for (auto &item : lanes) item.cv.notify_all();
+    for (auto &item : lanes) item.thread.join();
+  }
+
+  size_t assign() { return next++ % lanes.size(); }
+
+  void submit(size_t index, job item) {
+    std::unique_lock lock{ mtx };
+    space_cv.wait(lock, [&] { return queued == 0 || queued + item.data.size() <= limit || !error.empty(); });
+    check();
+    queued += item.data.size();
+    lanes[index].jobs.emplace_back(std::move(item));
+    lanes[index].cv.notify_one();
+  }
+
+  void drain() {
+    std::unique_lock lock{ mtx };
+    idle_cv.wait(lock, [&] {
+      if (busy) return false;
+      for (auto &item : lanes)
+        if (!item.jobs.empty()) return false;
+      return true;
+    });
+    check();
+  }
+};